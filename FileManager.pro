@@ -40,7 +40,10 @@ SOURCES += main.cpp\
     iconfetcher.cpp \
     fileutils.cpp \
     filebrowser.cpp \
-    navigationbar.cpp
+    navigationbar.cpp \
+    checksum.cpp \
+    storage.cpp \
+    codec.cpp
 
 HEADERS  += mainwindow.h \
     pixmapcache.h \
@@ -72,7 +75,11 @@ HEADERS  += mainwindow.h \
     iconfetcher.h \
     fileutils.h \
     filebrowser.h \
-    navigationbar.h
+    navigationbar.h \
+    checksum.h \
+    storage.h \
+    codec.h \
+    workqueue.h
     common.h
 
 FORMS    += mainwindow.ui \
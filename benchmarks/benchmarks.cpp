@@ -0,0 +1,413 @@
+/*
+ * Copyright (C) 2017 Zvaigznu Planetarijs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+//
+// includes
+//
+#include <QtTest>
+#include <QBuffer>
+#include <QDataStream>
+#include <QtConcurrent>
+#include <QTemporaryDir>
+#include "benchmarks.h"
+#include "checksum.h"
+#include "cache.h"
+#include "worker.h"
+#include "main.h"
+
+//
+// classes
+//
+class Main m;
+
+//
+// statics
+//
+volatile quint64 Benchmarks::sink = 0;
+
+/**
+ * @brief Main::Main (settings of benchmark runs are kept apart from the app's)
+ */
+Main::Main() : cache( nullptr ), iconCache( nullptr ), pixmapCache( nullptr ), m_gui( nullptr ), m_notifications( nullptr ) {
+    this->settings = new QSettings( QDir::tempPath() + "/filemanager-benchmarks/settings.conf", QSettings::IniFormat );
+}
+
+/**
+ * @brief Main::~Main
+ */
+Main::~Main() {
+    delete this->settings;
+}
+
+/**
+ * @brief Benchmarks::randomBytes
+ * @param size
+ * @return the same pseudo-random bytes on every run
+ */
+QByteArray Benchmarks::randomBytes( int size ) {
+    QByteArray bytes( size, Qt::Uninitialized );
+    quint32 state = 0x2545f491;
+    int y;
+
+    for ( y = 0; y < size; y++ ) {
+        state = state * 1664525 + 1013904223;
+        bytes[y] = static_cast<char>( state >> 24 );
+    }
+
+    return bytes;
+}
+
+/**
+ * @brief Benchmarks::sourceImage
+ * @param alpha an icon-like disc on a transparent background instead of a photo
+ * @param width
+ * @param height
+ * @return smooth gradients with a little grain, the same on every run
+ */
+QImage Benchmarks::sourceImage( bool alpha, int width, int height ) {
+    QImage image( width, height, alpha ? QImage::Format_ARGB32 : QImage::Format_RGB32 );
+    const int radius = qMin( width, height ) / 2;
+    quint32 state = 0x2545f491;
+    int x, y;
+
+    for ( y = 0; y < height; y++ ) {
+        QRgb *line = reinterpret_cast<QRgb *>( image.scanLine( y ));
+
+        for ( x = 0; x < width; x++ ) {
+            const int distance = ( x - width / 2 ) * ( x - width / 2 ) + ( y - height / 2 ) * ( y - height / 2 );
+            int grain, opacity = 255;
+
+            state = state * 1664525 + 1013904223;
+            grain = static_cast<int>( state >> 28 ) - 8;
+
+            // soft edged disc
+            if ( alpha )
+                opacity = distance >= radius * radius ? 0 : qMin( 255, ( radius * radius - distance ) * 4 / radius );
+
+            line[x] = qRgba( qBound( 0, x * 255 / width + grain, 255 ), qBound( 0, y * 255 / height + grain, 255 ), qBound( 0, ( x + y ) * 255 / ( width + height ) + grain, 255 ), opacity );
+        }
+    }
+
+    return image;
+}
+
+/**
+ * @brief Benchmarks::sourceFile
+ * @param alpha
+ * @return contents of a source file as read from disk (jpeg photo or png icon)
+ */
+QByteArray Benchmarks::sourceFile( bool alpha ) {
+    QByteArray bytes;
+    QBuffer buffer( &bytes );
+
+    buffer.open( QIODevice::WriteOnly );
+    Benchmarks::sourceImage( alpha, 640, 480 ).save( &buffer, alpha ? "PNG" : "JPG" );
+
+    return bytes;
+}
+
+/**
+ * @brief Benchmarks::checksum_data
+ */
+void Benchmarks::checksum_data() {
+    const int sizes[] = { 4096, 65536, 16777216 };
+    int kernel, y;
+
+    QTest::addColumn<int>( "kernel" ); // -1 - the old Cache::checksum (Checksum::Legacy)
+    QTest::addColumn<int>( "size" );
+
+    for ( y = 0; y < 3; y++ ) {
+        const int size = sizes[y];
+
+        QTest::newRow( qPrintable( QString( "legacy %1" ).arg( size ))) << -1 << size;
+
+        for ( kernel = Checksum::Scalar; kernel <= Checksum::NEON; kernel++ ) {
+            if ( Checksum::isSupported( static_cast<Checksum::Kernels>( kernel )))
+                QTest::newRow( qPrintable( QString( "%1 %2" ).arg( Checksum::kernelName( static_cast<Checksum::Kernels>( kernel ))).arg( size ))) << kernel << size;
+        }
+    }
+}
+
+/**
+ * @brief Benchmarks::checksum hashing throughput per kernel against the old checksum
+ */
+void Benchmarks::checksum() {
+    QFETCH( int, kernel );
+    QFETCH( int, size );
+    const QByteArray buffer( Benchmarks::randomBytes( size ));
+    qreal bytesPerSecond;
+
+    if ( kernel < 0 ) {
+        bytesPerSecond = Benchmarks::rate( [&buffer]() {
+            Checksum::Legacy legacy;
+
+            legacy.update( buffer.constData(), static_cast<size_t>( buffer.size()));
+            Benchmarks::sink = Benchmarks::sink + legacy.digest();
+        }, size );
+    } else {
+        const Checksum::Kernels k = static_cast<Checksum::Kernels>( kernel );
+
+        // all kernels produce identical results
+        QCOMPARE( Checksum::hash64( buffer.constData(), static_cast<size_t>( size ), k ), Checksum::hash64( buffer.constData(), static_cast<size_t>( size ), Checksum::Scalar ));
+
+        bytesPerSecond = Benchmarks::rate( [&buffer, k]() {
+            Benchmarks::sink = Benchmarks::sink + Checksum::hash64( buffer.constData(), static_cast<size_t>( buffer.size()), k );
+        }, size );
+    }
+
+    QTest::setBenchmarkResult( bytesPerSecond, QTest::BytesPerSecond );
+    qDebug() << this->tr( "Benchmarks::checksum: %1 GB/s" ).arg( bytesPerSecond / 1000000000.0, 0, 'f', 2 );
+}
+
+/**
+ * @brief Benchmarks::codec_data
+ */
+void Benchmarks::codec_data() {
+    const char *codecs[] = { "stream", "png", "qoi", "jpeg" };
+    int codec;
+
+    QTest::addColumn<bool>( "alpha" );
+    QTest::addColumn<int>( "codec" ); // -1 - the old pixmap stream
+
+    for ( codec = -1; codec <= Codec::Jpeg; codec++ ) {
+        QTest::newRow( qPrintable( QString( "photo %1" ).arg( codecs[codec + 1] ))) << false << codec;
+        QTest::newRow( qPrintable( QString( "icon %1" ).arg( codecs[codec + 1] ))) << true << codec;
+    }
+}
+
+/**
+ * @brief Benchmarks::codec stored size and decoding time of a thumbnail against the old pixmap stream
+ */
+void Benchmarks::codec() {
+    QFETCH( bool, alpha );
+    QFETCH( int, codec );
+    const char *codecs[] = { "png", "qoi", "jpeg" };
+    QByteArray bytes;
+    QString name( "stream" );
+    qreal thumbnailsPerSecond;
+    bool ok;
+
+    const QImage thumbnail( Worker::generateThumbnail( Benchmarks::sourceFile( alpha ), CacheSystem::PixmapLevels[0], ok ));
+    const QList<QImage> levels( Worker::generateImageLevels( thumbnail ));
+    QVERIFY( ok );
+
+    if ( codec < 0 ) {
+        // every level streamed as png, as the cache stored them before
+        QDataStream out( &bytes, QIODevice::WriteOnly );
+        out << levels;
+
+        thumbnailsPerSecond = Benchmarks::rate( [&bytes]() {
+            QList<QImage> decoded;
+            QDataStream in( bytes );
+
+            in >> decoded;
+            Benchmarks::sink = Benchmarks::sink + static_cast<quint64>( decoded.count());
+        }, 1 );
+    } else {
+        DataEntry entry( "image/png", levels ), stored;
+        Codec::Codecs used = static_cast<Codec::Codecs>( codec );
+
+        // largest level only, the rest are derived while decoding (jpeg falls back to qoi for alpha)
+        entry.quality = CacheSystem::DefaultQuality;
+        bytes = entry.encode( used );
+        stored.encoded = bytes;
+        stored.levels = static_cast<quint8>( levels.count());
+        stored.codec = static_cast<quint8>( used );
+        name = codecs[used];
+
+        thumbnailsPerSecond = Benchmarks::rate( [&stored]() {
+            DataEntry read( stored );
+
+            read.decode();
+            Benchmarks::sink = Benchmarks::sink + static_cast<quint64>( read.count());
+        }, 1 );
+    }
+
+    QVERIFY( !bytes.isEmpty());
+    QTest::setBenchmarkResult( 1000.0 / thumbnailsPerSecond, QTest::WalltimeMilliseconds );
+    qDebug() << this->tr( "Benchmarks::codec: %1 bytes, %2 us per thumbnail (%3)" ).arg( bytes.size()).arg( 1000000.0 / thumbnailsPerSecond, 0, 'f', 1 ).arg( name );
+}
+
+/**
+ * @brief Benchmarks::thumbnails_data
+ */
+void Benchmarks::thumbnails_data() {
+    const int cores = QThread::idealThreadCount();
+    int threads;
+
+    QTest::addColumn<int>( "threads" );
+
+    for ( threads = 1; threads < cores; threads *= 2 )
+        QTest::newRow( qPrintable( QString( "%1 threads" ).arg( threads ))) << threads;
+    QTest::newRow( qPrintable( QString( "%1 threads" ).arg( qMax( 1, cores )))) << qMax( 1, cores );
+}
+
+/**
+ * @brief Benchmarks::thumbnails generation throughput by number of threads (scaling per core)
+ */
+void Benchmarks::thumbnails() {
+    QFETCH( int, threads );
+    const QByteArray sources[] = { Benchmarks::sourceFile( false ), Benchmarks::sourceFile( true ) };
+    const int maxThreads = QThreadPool::globalInstance()->maxThreadCount();
+    qreal thumbnailsPerSecond;
+
+    // threads take the next thumbnail of the batch until it is done, like the work pool
+    QThreadPool::globalInstance()->setMaxThreadCount( threads );
+    thumbnailsPerSecond = Benchmarks::rate( [&sources, threads]() {
+        QList<QFuture<void> > futures;
+        QAtomicInt next( 0 ), levels( 0 );
+        int y;
+
+        for ( y = 0; y < threads; y++ ) {
+            futures << QtConcurrent::run( [&sources, &next, &levels]() {
+                int k;
+
+                while (( k = next.fetchAndAddRelaxed( 1 )) < BenchmarkSystem::ThumbnailBatch ) {
+                    bool ok;
+
+                    levels.fetchAndAddRelaxed( Worker::generateImageLevels( Worker::generateThumbnail( sources[k % 2], CacheSystem::PixmapLevels[0], ok )).count());
+                }
+            } );
+        }
+
+        foreach ( QFuture<void> future, futures )
+            future.waitForFinished();
+
+        Benchmarks::sink = Benchmarks::sink + static_cast<quint64>( levels.load());
+    }, BenchmarkSystem::ThumbnailBatch );
+    QThreadPool::globalInstance()->setMaxThreadCount( maxThreads );
+
+    QTest::setBenchmarkResult( thumbnailsPerSecond, QTest::FramesPerSecond );
+    qDebug() << this->tr( "Benchmarks::thumbnails: %1 thumbnails/s on %2 threads, %3 per thread" ).arg( thumbnailsPerSecond, 0, 'f', 0 ).arg( threads ).arg( thumbnailsPerSecond / threads, 0, 'f', 0 );
+}
+
+/**
+ * @brief Benchmarks::readMode_data
+ */
+void Benchmarks::readMode_data() {
+    QTest::addColumn<int>( "mode" );
+    QTest::addColumn<bool>( "thumbnails" ); // mimetype only otherwise, as most files are
+
+    QTest::newRow( "mapped mimetypes" ) << static_cast<int>( Cache::MappedRead ) << false;
+    QTest::newRow( "stream mimetypes" ) << static_cast<int>( Cache::StreamRead ) << false;
+    QTest::newRow( "mapped thumbnails" ) << static_cast<int>( Cache::MappedRead ) << true;
+    QTest::newRow( "stream thumbnails" ) << static_cast<int>( Cache::StreamRead ) << true;
+}
+
+/**
+ * @brief Benchmarks::readMode lookups of viewport sized batches in both read modes on the same data file
+ */
+void Benchmarks::readMode() {
+    QFETCH( int, mode );
+    QFETCH( bool, thumbnails );
+    QTemporaryDir dir;
+    QList<Hash> hashes;
+    QList<QImage> levels;
+    qreal entriesPerSecond;
+    int position = 0, y;
+    bool ok;
+
+    QVERIFY( dir.isValid());
+    Cache cache( dir.path());
+    QVERIFY( cache.isValid());
+
+    // entries of a directory are written one after another
+    if ( thumbnails )
+        levels = Worker::generateImageLevels( Worker::generateThumbnail( Benchmarks::sourceFile( false ), CacheSystem::PixmapLevels[0], ok ));
+    const DataEntry entry( thumbnails ? "image/jpeg" : "text/plain", levels );
+    for ( y = 0; y < BenchmarkSystem::ReadEntries; y++ ) {
+        const QByteArray name( QString( "file%1" ).arg( y ).toLatin1());
+        const Hash hash( Checksum::hash64( name.constData(), static_cast<size_t>( name.size())), 1024 + y );
+
+        QVERIFY( cache.write( hash, entry ));
+        hashes << hash;
+    }
+    cache.flush();
+    cache.finishMaintenance();
+
+    // every lookup goes to the data file
+    cache.setHotTierSize( 0 );
+    cache.setReadMode( static_cast<Cache::ReadModes>( mode ));
+    QCOMPARE( cache.cachedData( hashes.mid( 0, BenchmarkSystem::ReadBatch )).last().mimeType, entry.mimeType );
+
+    // scrolling through the directory
+    entriesPerSecond = Benchmarks::rate( [&cache, &hashes, &position]() {
+        const QList<DataEntry> entries( cache.cachedData( hashes.mid( position, BenchmarkSystem::ReadBatch )));
+
+        position = ( position + BenchmarkSystem::ReadBatch ) % BenchmarkSystem::ReadEntries;
+        Benchmarks::sink = Benchmarks::sink + static_cast<quint64>( entries.count());
+    }, BenchmarkSystem::ReadBatch );
+
+    QTest::setBenchmarkResult( 1000.0 / entriesPerSecond, QTest::WalltimeMilliseconds );
+    qDebug() << this->tr( "Benchmarks::readMode: %1 us per entry (%2)" ).arg( 1000000.0 / entriesPerSecond, 0, 'f', 2 ).arg( mode == Cache::MappedRead ? "mapped" : "stream" );
+}
+
+/**
+ * @brief Benchmarks::writes_data
+ */
+void Benchmarks::writes_data() {
+    QTest::addColumn<bool>( "batched" ); // committed once per entry otherwise, as before batching
+    QTest::addColumn<bool>( "thumbnails" );
+
+    QTest::newRow( "batched mimetypes" ) << true << false;
+    QTest::newRow( "per entry mimetypes" ) << false << false;
+    QTest::newRow( "batched thumbnails" ) << true << true;
+    QTest::newRow( "per entry thumbnails" ) << false << true;
+}
+
+/**
+ * @brief Benchmarks::writes inserts per second with batched and with per-entry commits
+ */
+void Benchmarks::writes() {
+    QFETCH( bool, batched );
+    QFETCH( bool, thumbnails );
+    QTemporaryDir dir;
+    QList<QImage> levels;
+    qreal insertsPerSecond;
+    int count = 0;
+    bool ok;
+
+    QVERIFY( dir.isValid());
+    Cache cache( dir.path());
+    QVERIFY( cache.isValid());
+
+    if ( thumbnails )
+        levels = Worker::generateImageLevels( Worker::generateThumbnail( Benchmarks::sourceFile( false ), CacheSystem::PixmapLevels[0], ok ));
+    const DataEntry entry( thumbnails ? "image/jpeg" : "text/plain", levels );
+
+    // every run ends committed, merges and compactions are applied as they come
+    insertsPerSecond = Benchmarks::rate( [&cache, &entry, &count, batched]() {
+        int y;
+
+        for ( y = 0; y < BenchmarkSystem::WriteRun; y++, count++ ) {
+            const QByteArray name( QString( "file%1" ).arg( count ).toLatin1());
+
+            cache.write( Hash( Checksum::hash64( name.constData(), static_cast<size_t>( name.size())), 1024 + count ), entry );
+            if ( !batched )
+                cache.flush();
+        }
+
+        cache.flush();
+        cache.finishMaintenance();
+    }, BenchmarkSystem::WriteRun );
+
+    QTest::setBenchmarkResult( 1000.0 / insertsPerSecond, QTest::WalltimeMilliseconds );
+    qDebug() << this->tr( "Benchmarks::writes: %1 inserts/s (%2, %3 entries written)" ).arg( insertsPerSecond, 0, 'f', 0 ).arg( batched ? "batched" : "per entry" ).arg( count );
+}
+
+QTEST_GUILESS_MAIN( Benchmarks )
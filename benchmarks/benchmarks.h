@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2017 Zvaigznu Planetarijs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#pragma once
+
+//
+// includes
+//
+#include <QObject>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QImage>
+
+/**
+ * @brief The BenchmarkSystem namespace
+ */
+namespace BenchmarkSystem {
+    static const qint64 MinTime = 250; // ms per measurement
+    static const int ThumbnailBatch = 64; // thumbnails per timed run
+    static const int ReadEntries = 4096; // entries in the data file
+    static const int ReadBatch = 64; // entries per lookup, about a viewport
+    static const int WriteRun = 256; // entries per timed run
+}
+
+/**
+ * @brief The Benchmarks class
+ *
+ * throughput of the cache pipeline against what it replaced; each result is
+ * reported to QTest and logged in the unit it is usually quoted in
+ */
+class Benchmarks : public QObject {
+    Q_OBJECT
+
+private slots:
+    void checksum_data();
+    void checksum();
+    void codec_data();
+    void codec();
+    void thumbnails_data();
+    void thumbnails();
+    void readMode_data();
+    void readMode();
+    void writes_data();
+    void writes();
+
+private:
+    static QByteArray randomBytes( int size );
+    static QImage sourceImage( bool alpha, int width, int height );
+    static QByteArray sourceFile( bool alpha );
+    template<typename Job> static qreal rate( Job job, qint64 units );
+    static volatile quint64 sink; // keeps results of timed jobs alive
+};
+
+/**
+ * @brief Benchmarks::rate runs a job over and over for at least MinTime
+ * @param job
+ * @param units processed by a single run
+ * @return units per second
+ */
+template<typename Job>
+qreal Benchmarks::rate( Job job, qint64 units ) {
+    QElapsedTimer timer;
+    qint64 runs = 0;
+
+    // warm up caches and lazily initialized state
+    job();
+
+    timer.start();
+    do {
+        job();
+        runs++;
+    } while ( timer.elapsed() < BenchmarkSystem::MinTime );
+
+    return static_cast<qreal>( runs * units ) * 1000000000.0 / static_cast<qreal>( timer.nsecsElapsed());
+}
@@ -0,0 +1,41 @@
+#-------------------------------------------------
+#
+# Benchmarks of the cache pipeline
+#   qmake benchmarks.pro && make && ./benchmarks
+#
+#-------------------------------------------------
+
+QT       += core gui concurrent testlib
+
+win32:QT += winextras
+
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TARGET = benchmarks
+TEMPLATE = app
+
+INCLUDEPATH += ..
+
+SOURCES += benchmarks.cpp \
+    ../checksum.cpp \
+    ../codec.cpp \
+    ../storage.cpp \
+    ../filestream.cpp \
+    ../cache.cpp \
+    ../indexer.cpp \
+    ../worker.cpp
+
+HEADERS  += benchmarks.h \
+    ../checksum.h \
+    ../codec.h \
+    ../storage.h \
+    ../filestream.h \
+    ../cache.h \
+    ../indexer.h \
+    ../worker.h \
+    ../workqueue.h \
+    ../main.h \
+    ../variable.h
+
+win32:LIBS += -lgdi32 -ldwmapi -luser32
@@ -21,9 +21,20 @@
 //
 #include <QDebug>
 #include <QThread>
+#include <QElapsedTimer>
+#include <QtConcurrent>
+#include <QtEndian>
+#include <QDateTime>
+#include <QImage>
+#include <QMimeDatabase>
+#include <QDirIterator>
+#include <QCoreApplication>
+#include <limits>
+#include <algorithm>
 #include "cache.h"
 #include "worker.h"
 #include "indexer.h"
+#include "variable.h"
 
 /*
   The Cache Subsystem
@@ -33,8 +44,38 @@
 
   DETAIL:
     contains 3 different file types:
-      index.cache - holds file hashes, sizes and offsets in the data file
-      data.cache - thumbnail and mimetype cache data file
+      files.index - holds the hash policy and sorted fixed-width records (hash, size, offset in the data file)
+      files.tail - holds unsorted crc32-protected records appended since the last merge
+      files.data - thumbnail and mimetype cache data file (length, crc32, entry frames)
+      files.paths - maps file stat (device, inode, size, mtime) to content hash
+      files.negative - stat keys of empty and unidentified files (unreadable ones are kept for the session only)
+      files.dirs - maps content hash to the directory it was last seen in
+      files.bundles - contiguous per-directory ranges of the data file
+      files.lock, files.maintenance - lock files shared by all instances
+
+    entries are content-addressed, so they are valid for identical files
+    anywhere; packs (header, then hash + entry frames) carry them between
+    machines, e.g. thumbnails of a shared folder generated once
+
+    lookups binary search the mapped index, the tail is kept in memory and
+    merged into the index in the background once it grows large enough
+
+    files that have not changed since the last visit are resolved through
+    the path index and skip hashing altogether
+
+    once the data file exceeds the size budget, the most recently accessed
+    entries are rewritten into fresh files in the background (grouped by
+    directory, hot first) and swapped in; the rest (including entries of
+    deleted files) is dropped; entering a directory prefetches its bundle
+
+    several instances share the files: appends are made by one instance at a
+    time (files.lock), merges and compactions by one at a time as well
+    (files.maintenance); others pick up new tail records as they go and reopen
+    the files once they have been swapped
+
+    frames, the writer lock (StorageLock) and swap detection (Storage::replaced)
+    are those of the Storage engine under the icon and pixmap caches; the sorted
+    index, tail and data files themselves stay specific to this cache
 
   CHANGELOG:
     v3:
@@ -45,19 +86,92 @@
       implemented in app
     v4:
       more optimizations (loading, caching)
+    v5:
+      pixmap levels stored as separately encoded blobs
+      memory-mapped read path for the data file
+    v6:
+      sorted fixed-width index with an append-only tail
+      lazy index lookups instead of replaying the whole index at startup
+    v7:
+      record lengths and access times in index
+      size-budgeted compaction with LRU eviction
+    v8:
+      stat-keyed path index
+    v9:
+      64-bit checksum with SSE2/AVX2/NEON kernels selected at runtime
+    v10:
+      large files hashed from sampled chunks plus size and mtime
+      hash policy stored in index header
+    v11:
+      batched writes, synced once per batch
+      crc32-protected tail/path records and length-prefixed data frames
+      startup recovery truncates to the last valid record, version mismatch resets the cache
+      version 2 caches kept aside and migrated as files are visited
+      batched lookups, cached entries of a screen read in data file order
+      negative store, files without an entry are not rehashed until modified
+      only the largest level stored (QOI by default, JPEG or PNG), smaller ones derived
+      shared by several instances (single writer, readers pick up appends)
+      portable packs of the entries of a directory tree (export, import)
+      files read once, the hashed bytes are sniffed and decoded as well
 
   TODOs:
-    failsafe mode for corrupted/wrong version cache
     store jumbo icons in separate file (no need to regeneate duplicates)
 */
 
+//
+// source buffer accounting
+//
+QAtomicInt SourceBuffer::buffered;
+QAtomicInteger<qint64> SourceBuffer::read;
+
+/**
+ * @brief SourceBuffer::reserve
+ * @param size
+ * @return buffer of the given size, null if over budget
+ */
+QSharedPointer<SourceBuffer> SourceBuffer::reserve( qint64 size ) {
+    QSharedPointer<SourceBuffer> source;
+
+    if ( size <= 0 || size > CacheSystem::MaxFileSize )
+        return source;
+
+    if ( SourceBuffer::buffered.fetchAndAddRelaxed( static_cast<int>( size )) + size > CacheSystem::MaxBufferedBytes ) {
+        SourceBuffer::buffered.fetchAndAddRelaxed( -static_cast<int>( size ));
+        return source;
+    }
+
+    source = QSharedPointer<SourceBuffer>( new SourceBuffer( static_cast<int>( size )));
+    source->bytes.resize( static_cast<int>( size ));
+    return source;
+}
+
 /**
  * @brief Cache::Cache
  * @param path
  */
-Cache::Cache( const QString &path ) : m_path( path ), m_valid( true ) {
+Cache::Cache( const QString &path ) : m_path( path ), resultTimer( this ), hotHits( 0 ), hotMisses( 0 ), hotEvictions( 0 ), m_codec( CacheSystem::DefaultCodec ), m_quality( CacheSystem::DefaultQuality ), bundled( true ), pendingCount( 0 ), batchCount( 0 ), batchedCount( 0 ), tailCount( 0 ), mergeSnapshot( 0 ), mergeWatcher( this ), compactionSnapshot( 0 ), compactionDataSnapshot( 0 ), compactionWatcher( this ), legacyWatcher( this ), migratedCount( 0 ), m_valid( true ), m_readMode( MappedRead ), readCount( 0 ), readTime( 0 ), viewportCount( 0 ), viewportTime( 0 ), viewportWorst( 0 ), viewportDropped( 0 ), writerLock( path + "/" + CacheSystem::LockFilename ), maintenanceLock( path + "/" + CacheSystem::MaintenanceLockFilename ), committed( 0 ), tailPos( 0 ) {
+    int threads, y;
+
     this->cacheDir = QDir( this->path());
 
+    // size budget
+    Variable::add( "cache/sizeBudget", CacheSystem::DefaultSizeBudget );
+    this->setSizeBudget( static_cast<qint64>( Variable::integer( "cache/sizeBudget" )) * 1048576 );
+
+    // in-memory tier in front of the data file
+    Variable::add( "cache/hotTierSize", CacheSystem::DefaultHotTierSize );
+    this->setHotTierSize( Variable::integer( "cache/hotTierSize" ) * 1048576 );
+
+    // thumbnail encoding
+    Variable::add( "cache/thumbnailCodec", CacheSystem::DefaultCodec );
+    Variable::add( "cache/thumbnailQuality", CacheSystem::DefaultQuality );
+    this->m_codec = static_cast<quint8>( qBound( static_cast<int>( Codec::Png ), Variable::integer( "cache/thumbnailCodec" ), static_cast<int>( Codec::Jpeg )));
+    this->m_quality = qBound( 0, Variable::integer( "cache/thumbnailQuality" ), 100 );
+
+    // group entries by directory during compaction
+    Variable::add( "cache/directoryBundles", true );
+    this->bundled = Variable::isEnabled( "cache/directoryBundles" );
+
     // check if cache dir exists
     if ( !this->cacheDir.exists()) {
         qDebug() << this->tr( "Cache: creating non-existant cache dir" );
@@ -70,6 +184,25 @@ Cache::Cache( const QString &path ) : m_path( path ), m_valid( true ) {
         }
     }
 
+    // other instances share the cache files, only one of them writes at a time
+    // (a lock left behind by a crashed instance is taken over, never by age)
+    this->maintenanceLock.setStaleLockTime( 0 );
+    if ( !this->lock()) {
+        this->shutdown();
+        return;
+    }
+
+    // unless another instance is still at it
+    if ( this->maintenanceLock.tryLock( 0 )) {
+        // finish an interrupted merge
+        if ( !this->cacheDir.exists( CacheSystem::IndexFilename ) && this->cacheDir.exists( CacheSystem::IndexFilename + ".tmp" ))
+            this->cacheDir.rename( CacheSystem::IndexFilename + ".tmp", CacheSystem::IndexFilename );
+
+        // finish (or discard) an interrupted compaction
+        Cache::commitCompaction( this->cacheDir.absolutePath());
+        this->maintenanceLock.unlock();
+    }
+
     // set up index file
     this->index.setFilename( cacheDir.absolutePath() + "/" + CacheSystem::IndexFilename );
     if ( !this->index.open()) {
@@ -78,7 +211,15 @@ Cache::Cache( const QString &path ) : m_path( path ), m_valid( true ) {
         return;
     } else {
         if ( !this->index.size())
-            this->index << CacheSystem::Version;
+            this->index << CacheSystem::Version << HashPolicy();
+    }
+
+    // set up tail file
+    this->tail.setFilename( cacheDir.absolutePath() + "/" + CacheSystem::TailFilename );
+    if ( !this->tail.open()) {
+        qDebug() << this->tr( "Cache: tail file non-writable" );
+        this->shutdown();
+        return;
     }
 
     // set up data file
@@ -89,24 +230,79 @@ Cache::Cache( const QString &path ) : m_path( path ), m_valid( true ) {
         return;
     }
 
+    // set up path index (an accelerator only, failures are not fatal)
+    this->paths.setFilename( cacheDir.absolutePath() + "/" + CacheSystem::PathsFilename );
+    if ( this->paths.open())
+        this->readPaths();
+    else
+        qDebug() << this->tr( "Cache: path index non-writable" );
+
+    // set up negative store (files known to have no entry)
+    this->negatives.setFilename( cacheDir.absolutePath() + "/" + CacheSystem::NegativesFilename );
+    if ( this->negatives.open())
+        this->readNegatives();
+    else
+        qDebug() << this->tr( "Cache: negative store non-writable" );
+
+    // set up directory map and bundles (accelerators as well)
+    this->dirs.setFilename( cacheDir.absolutePath() + "/" + CacheSystem::DirectoriesFilename );
+    if ( this->dirs.open())
+        this->readDirectories();
+    else
+        qDebug() << this->tr( "Cache: directory map non-writable" );
+    this->readBundles();
+
+    // listen to background merges and compactions
+    this->connect( &this->mergeWatcher, SIGNAL( finished()), this, SLOT( mergeDone()));
+    this->connect( &this->compactionWatcher, SIGNAL( finished()), this, SLOT( compactionDone()));
+    this->connect( &this->legacyWatcher, SIGNAL( finished()), this, SLOT( legacyLoaded()));
+
+    // results are delivered in batches
+    this->resultTimer.setSingleShot( true );
+    this->resultTimer.setInterval( CacheSystem::ResultInterval );
+    this->connect( &this->resultTimer, SIGNAL( timeout()), this, SLOT( flushResults()));
+
     // reead data
     if ( !this->read()) {
         qDebug() << this->tr( "Cache: failed to read cache" );
         this->shutdown();
         return;
     }
+    this->unlock();
+    this->refreshTimer.start();
+
+    // hashing and decoding pools (results are still written by the cache alone)
+    Variable::add( "cache/threads", CacheSystem::DefaultThreads );
+    threads = Variable::integer( "cache/threads" );
+    if ( threads <= 0 )
+        threads = QThread::idealThreadCount();
+    this->indexPool.setSize( threads );
+    this->workPool.setSize( threads );
+    qDebug() << this->tr( "Cache: %1 indexer and worker threads" ).arg( this->indexPool.size());
+
+    // create indexers
+    for ( y = 0; y < this->indexPool.size(); y++ ) {
+        Indexer *indexer = new Indexer( this->hashPolicy(), &this->indexPool, y, &this->generation );
+
+        this->connect( indexer, SIGNAL( workDone( Work, quint32 )), this, SLOT( indexingDone( Work, quint32 )));
+        this->connect( indexer, SIGNAL( finished()), indexer, SLOT( deleteLater()));
+        indexer->start();
+        this->indexers << indexer;
+    }
+
+    // create workers
+    for ( y = 0; y < this->workPool.size(); y++ ) {
+        Worker *worker = new Worker( &this->workPool, y, &this->generation );
 
-    // create a new indexer
-    this->indexer = new Indexer();
-    this->connect( this->indexer, SIGNAL( workDone( QString, Hash )), this, SLOT( indexingDone( QString, Hash )));
-    this->connect( this->indexer, SIGNAL( finished()), this->indexer, SLOT( deleteLater()));
-    this->indexer->start();
+        this->connect( worker, SIGNAL( workDone( Work )), this, SLOT( workDone( Work )));
+        this->connect( worker, SIGNAL( idle()), this, SLOT( flush()));
+        this->connect( worker, SIGNAL( finished()), worker, SLOT( deleteLater()));
+        worker->start();
+        this->workers << worker;
+    }
 
-    // create a new worker
-    this->worker = new Worker();
-    this->connect( this->worker, SIGNAL( workDone( Work )), this, SLOT( workDone( Work )));
-    this->connect( this->worker, SIGNAL( finished()), this->worker, SLOT( deleteLater()));
-    this->worker->start();
+    // continue an unfinished migration (if any)
+    this->openLegacy();
 }
 
 /**
@@ -119,200 +315,2120 @@ bool Cache::read() {
         return false;
 
     // read index file version
-    quint8 version;
+    quint8 version = 0;
+    qint64 valid = 0;
     this->index.toStart();
     this->index >> version;
 
-    // check version
-    if ( version != CacheSystem::Version ) {
-        qDebug() << this->tr( "Cache::read: version mismatch for index file" );
-        this->shutdown();
+    // check version, convert or start over instead of disabling the cache
+    if ( version != CacheSystem::Version || this->index.size() < CacheSystem::IndexHeaderSize ) {
+        if ( !this->migrate( version ))
+            return false;
+
+        this->index.toStart();
+        this->index >> version;
+    }
+
+    // hashes must be computed the way the index was built
+    this->index >> this->m_hashPolicy;
+
+    // index files are written whole, yet drop a partial record just in case
+    if (( this->index.size() - CacheSystem::IndexHeaderSize ) % CacheSystem::IndexRecordSize )
+        this->index.resize( this->index.size() - ( this->index.size() - CacheSystem::IndexHeaderSize ) % CacheSystem::IndexRecordSize );
+
+    // sorted records are not read, just mapped for lookups
+    if ( this->index.map() == nullptr ) {
+        qDebug() << this->tr( "Cache::read: could not map index file" );
         return false;
     }
 
-    // read indexes
-    while ( !this->index.atEnd()) {
+    // read tail (bounded by MaxTailEntries) up to the first torn or corrupted record
+    this->tail.toStart();
+    while ( !this->tail.atEnd()) {
         IndexEntry indexEntry;
-        this->index >> indexEntry;
+
+        if ( !Storage::readRecord( this->tail, indexEntry, CacheSystem::TailRecordSize ))
+            break;
+
         this->hash[Hash( indexEntry.hash, indexEntry.size )] = indexEntry;
+        this->tailCount++;
+        valid += CacheSystem::TailRecordSize;
+    }
+
+    // recover by truncating to the last valid record (writers hold the lock,
+    // so this is not an append of another instance in progress)
+    if ( valid < this->tail.size()) {
+        qDebug() << this->tr( "Cache::read: discarding %1 damaged bytes at the end of tail" ).arg( this->tail.size() - valid );
+        this->tail.resetStatus();
+        this->tail.resize( valid );
     }
 
+    // read so far, later appends of other instances are picked up in refresh()
+    this->tailPos = valid;
+    this->committed = this->data.size();
+    this->identify();
+
     // report
-    qDebug() << this->tr( "Cache::read: found %1 entries in index file" ).arg( this->hash.count());
+    qDebug() << this->tr( "Cache::read: found %1 entries in index file, %2 in tail" ).arg(( this->index.mappedSize() - CacheSystem::IndexHeaderSize ) / CacheSystem::IndexRecordSize ).arg( this->tailCount );
+    qDebug() << this->tr( "Cache::read: using %1 checksum kernel" ).arg( Checksum::kernelName( Checksum::kernel()));
+    qDebug() << this->tr( "Cache::read: sampling files over %1 bytes (%2x%3 bytes)" ).arg( this->m_hashPolicy.threshold ).arg( this->m_hashPolicy.chunks ).arg( this->m_hashPolicy.chunkSize );
+
+    // leftovers from the previous session
+    if ( this->data.size() > this->sizeBudget())
+        this->compact();
+    else if ( this->tailCount >= CacheSystem::MaxTailEntries )
+        this->mergeTail();
 
     // return success
     return true;
 }
 
 /**
- * @brief Cache::write
- * @param hash
- * @param size
- * @param mimeType
- * @param pixmapList
+ * @brief Cache::reset starts over with empty cache files
  * @return
  */
-bool Cache::write( quint32 hash, qint64 size, const QString &mimeType, QList<QPixmap> pixmapList ) {
-    // failsafe
-    if ( !this->isValid())
+bool Cache::reset() {
+    const QString path( this->cacheDir.absolutePath() + "/" );
+    QFile outIndex( path + CacheSystem::IndexFilename + StorageSystem::CompactSuffix ), outTail( path + CacheSystem::TailFilename + StorageSystem::CompactSuffix ), outData( path + CacheSystem::DataFilename + StorageSystem::CompactSuffix );
+    QFile marker( path + CacheSystem::CompactionMarker );
+
+    // compaction files of another instance must not be swapped in by mistake
+    if ( !this->maintenanceLock.tryLock( 0 )) {
+        qDebug() << this->tr( "Cache::reset: cache files are being compacted by another instance" );
         return false;
+    }
 
-    // check hash
-    if ( hash == 0 || size == 0 || mimeType.length() == 0 ) {
-       // qDebug() << this->tr( "Cache::write: zero length hash, size or mimeType" );
+    // data of unknown layout is of no use, yet other instances may still have
+    // the files mapped - empty files are swapped in (the old inodes stay valid
+    // for them until they reopen), never truncated in place
+    if ( !outIndex.open( QFile::WriteOnly | QFile::Truncate ) || !outTail.open( QFile::WriteOnly | QFile::Truncate ) || !outData.open( QFile::WriteOnly | QFile::Truncate )) {
+        this->maintenanceLock.unlock();
         return false;
     }
 
-    // check for duplicates
-    if ( this->contains( hash, size ))
-        return true;
+    // write new header
+    QDataStream indexStream( &outIndex );
+    indexStream << CacheSystem::Version << HashPolicy();
+    if ( indexStream.status() != QDataStream::Ok || !FileStream::datasync( outIndex )) {
+        outIndex.remove();
+        this->maintenanceLock.unlock();
+        return false;
+    }
+    outIndex.close();
+    outTail.close();
+    outData.close();
 
-    // create new index entry
-    IndexEntry indexEntry( hash, size, this->data.size());
-    this->index.seek( FileStream::End );
-    this->index << indexEntry;
+    // from here on the swap is finished even if interrupted
+    marker.open( QFile::WriteOnly );
+    marker.close();
 
-    // add new enty to list
-    this->hash[Hash( indexEntry.hash, indexEntry.size )] = indexEntry;
+    this->index.close();
+    this->tail.close();
+    this->data.close();
+    this->cacheDir.remove( CacheSystem::BundlesFilename );
+    Cache::commitCompaction( this->cacheDir.absolutePath());
+    this->maintenanceLock.unlock();
+    if ( !this->index.open() || !this->tail.open() || !this->data.open())
+        return false;
 
-    // create new data entry
-    DataEntry dataEntry( mimeType, pixmapList );
-    this->data.seek( FileStream::End );
-    this->data << dataEntry;
+    this->hash.clear();
+    this->damaged.clear();
+    this->hot.clear();
+    this->directories.clear();
+    this->bundles.clear();
+    this->writeDirectories();
+    this->pendingData.clear();
+    this->pendingTail.clear();
+    this->pendingEntries.clear();
+    this->pendingCount = 0;
+    this->tailCount = 0;
+    this->tailPos = 0;
+    this->committed = 0;
+    this->identify();
 
-    // return success
     return true;
 }
 
 /**
- * @brief Cache::cachedData
- * @param index
+ * @brief Cache::migrate
+ * @param version
  * @return
  */
-DataEntry Cache::cachedData( quint32 hash, qint64 size ) {
-    DataEntry entry;
+bool Cache::migrate( quint8 version ) {
+    QString indexFilename( this->cacheDir.absolutePath() + "/" + CacheSystem::IndexFilename );
+    QString dataFilename( this->cacheDir.absolutePath() + "/" + CacheSystem::DataFilename );
+
+    // version 2 entries are keyed by the old 32-bit checksum, which cannot be derived
+    // from the current one without the file itself; keep the old files aside and
+    // convert entries as their files are hashed again (see indexingDone)
+    if ( version == CacheSystem::LegacyVersion && !QFile::exists( indexFilename + CacheSystem::LegacySuffix )) {
+        this->index.close();
+        this->data.close();
+        if ( !QFile::rename( indexFilename, indexFilename + CacheSystem::LegacySuffix ) || !QFile::rename( dataFilename, dataFilename + CacheSystem::LegacySuffix ))
+            qDebug() << this->tr( "Cache::migrate: could not keep version %1 files" ).arg( version );
+
+        if ( !this->index.open() || !this->data.open())
+            return false;
+
+        qDebug() << this->tr( "Cache::migrate: migrating version %1 cache" ).arg( version );
+    } else {
+        // development layouts and unknown (or damaged) headers
+        qDebug() << this->tr( "Cache::migrate: version mismatch or damaged header in index file (%1), resetting cache" ).arg( version );
+    }
+
+    return this->reset();
+}
 
-    if ( !this->isValid() || !this->contains( hash, size ))
-        return entry;
+/**
+ * @brief Cache::openLegacy loads the old index in the background
+ */
+void Cache::openLegacy() {
+    if ( !this->cacheDir.exists( CacheSystem::IndexFilename + CacheSystem::LegacySuffix ))
+        return;
 
-    this->data.seek( FileStream::Set, this->hash[Hash( hash, size )].offset );
-    this->data >> entry;
+    this->legacyData.setFileName( this->cacheDir.absolutePath() + "/" + CacheSystem::DataFilename + CacheSystem::LegacySuffix );
+    if ( !this->legacyData.open( QFile::ReadOnly )) {
+        this->dropLegacy();
+        return;
+    }
 
-    return entry;
+    this->legacyWatcher.setFuture( QtConcurrent::run( &Cache::readLegacyIndex, this->cacheDir.absolutePath() + "/" + CacheSystem::IndexFilename + CacheSystem::LegacySuffix ));
 }
 
 /**
- * @brief Cache::shutdown
+ * @brief Cache::readLegacyIndex
+ * @param indexFilename
+ * @return
  */
-void Cache::shutdown() {
-    this->setValid( false );
-    this->index.close();
-    this->data.close();
+LegacyIndex Cache::readLegacyIndex( const QString &indexFilename ) {
+    QFile indexFile( indexFilename );
+    LegacyIndex legacyIndex;
+    quint8 version;
 
-    if ( this->indexer->isRunning()) {
-        this->indexer->requestInterruption();
-        this->indexer->wait();
+    // runs in a separate thread with its own file handle
+    if ( !indexFile.open( QFile::ReadOnly ))
+        return legacyIndex;
+
+    QDataStream indexStream( &indexFile );
+    indexStream >> version;
+    if ( version != CacheSystem::LegacyVersion )
+        return legacyIndex;
+
+    // v2 index entries: hash, size, offset
+    while ( !indexStream.atEnd()) {
+        quint32 hash;
+        qint64 size, offset;
+
+        indexStream >> hash >> size >> offset;
+        if ( indexStream.status() != QDataStream::Ok )
+            break;
+
+        legacyIndex[qMakePair( hash, size )] = offset;
     }
 
-    if ( this->worker->isRunning()) {
-        this->worker->requestInterruption();
-        this->worker->wait();
+    return legacyIndex;
+}
+
+/**
+ * @brief Cache::legacyLoaded
+ */
+void Cache::legacyLoaded() {
+    if ( !this->isValid())
+        return;
+
+    this->legacyIndex = this->legacyWatcher.result();
+    if ( this->legacyIndex.isEmpty()) {
+        this->dropLegacy();
+        return;
     }
+
+    // from now on indexers compute old checksums as well
+    foreach ( Indexer *indexer, this->indexers )
+        indexer->setLegacy( true );
+    qDebug() << this->tr( "Cache::legacyLoaded: %1 entries to migrate" ).arg( this->legacyIndex.count());
 }
 
 /**
- * @brief checksum
- * @param data
- * @param len
+ * @brief Cache::readLegacy converts an old entry (pixmaps streamed as images) to an encoded entry
+ * @param offset
+ * @param entry
  * @return
  */
-quint32 Cache::checksum( const char* data, size_t len ) {
-    const quint32 m = 0x5bd1e995, r = 24;
-    quint32 h = 0, w;
-    const char *l = data + len;
+bool Cache::readLegacy( qint64 offset, DataEntry &entry ) {
+    QList<QImage> imageList;
+
+    if ( !this->legacyData.isOpen() || !this->legacyData.seek( offset ))
+        return false;
+
+    // QPixmap is streamed as QImage, which can be decoded off the gui thread
+    QDataStream dataStream( &this->legacyData );
+    dataStream >> entry.mimeType >> imageList;
+    if ( dataStream.status() != QDataStream::Ok || entry.mimeType.isEmpty())
+        return false;
+
+    // keep the largest level only
+    if ( !imageList.isEmpty()) {
+        Codec::Codecs codec = static_cast<Codec::Codecs>( this->m_codec );
+
+        entry.encoded = Codec::encode( imageList.first(), codec, this->m_quality );
+        entry.levels = static_cast<quint8>( imageList.count());
+        entry.codec = static_cast<quint8>( codec );
+    }
+
+    return true;
+}
+
+/**
+ * @brief Cache::dropLegacy
+ */
+void Cache::dropLegacy() {
+    if ( this->migratedCount )
+        qDebug() << this->tr( "Cache::dropLegacy: migrated %1 entries" ).arg( this->migratedCount );
+
+    foreach ( Indexer *indexer, this->indexers )
+        indexer->setLegacy( false );
+
+    this->legacyIndex.clear();
+    this->legacyData.close();
+    this->cacheDir.remove( CacheSystem::IndexFilename + CacheSystem::LegacySuffix );
+    this->cacheDir.remove( CacheSystem::DataFilename + CacheSystem::LegacySuffix );
+}
+
+/**
+ * @brief Cache::readPaths
+ */
+void Cache::readPaths() {
+    quint8 version = 0;
+    int count = 0;
 
-    while ( data + 4 <= l ) {
-        w = *( reinterpret_cast<const quint32*>( data ));
-        data += 4;
-        h += w;
-        h *= m;
-        h ^= ( h >> 16 );
+    // path index holds content hashes, so it is tied to cache version
+    this->paths.toStart();
+    if ( this->paths.size())
+        this->paths >> version;
+
+    if ( version != CacheSystem::Version ) {
+        this->paths.clear();
+        this->paths.toStart();
+        this->paths << CacheSystem::Version;
+        return;
     }
 
-    switch ( l - data ) {
-    case 3:
-        h += data[2] << 16;
+    // read records up to the first torn one, newer ones override stale ones
+    while ( !this->paths.atEnd()) {
+        QPair<StatKey, quint64> record;
+
+        if ( !Storage::readRecord( this->paths, record, CacheSystem::PathRecordSize ))
+            break;
 
-    case 2:
-        h += data[1] << 8;
+        this->pathIndex[record.first] = record.second;
+        count++;
+    }
+
+    // rewrite if mostly stale records (modified files) or damaged
+    if ( count > 2 * this->pathIndex.count() + 1024 || this->paths.size() != 1 + count * static_cast<qint64>( CacheSystem::PathRecordSize )) {
+        QHash<StatKey, quint64>::const_iterator i;
 
-    case 1:
-        h += data[0];
-        h *= m;
-        h ^= ( h >> r );
-        break;
+        this->paths.resetStatus();
+        this->paths.clear();
+        this->paths.toStart();
+        this->paths << CacheSystem::Version;
+        for ( i = this->pathIndex.constBegin(); i != this->pathIndex.constEnd(); ++i )
+            Storage::writeRecord( this->paths, qMakePair( i.key(), i.value()));
     }
-    return h;
+
+    // report
+    qDebug() << this->tr( "Cache::readPaths: found %1 entries in path index" ).arg( this->pathIndex.count());
 }
 
 /**
- * @brief Cache::process
+ * @brief Cache::readNegatives
+ */
+void Cache::readNegatives() {
+    quint8 version = 0;
+    int count = 0;
+
+    this->negatives.toStart();
+    if ( this->negatives.size())
+        this->negatives >> version;
+
+    // read records up to the first torn one
+    if ( version == CacheSystem::Version ) {
+        while ( !this->negatives.atEnd()) {
+            QPair<StatKey, quint8> record;
+
+            if ( !Storage::readRecord( this->negatives, record, CacheSystem::NegativeRecordSize ))
+                break;
+
+            // left by older versions, permissions may have changed since (pruned below)
+            count++;
+            if ( record.second == CacheSystem::UnreadableFile )
+                continue;
+
+            this->negativeIndex[record.first] = record.second;
+        }
+    }
+
+    // modified files leave stale keys behind, start over once there are too many
+    if ( this->negativeIndex.count() > CacheSystem::MaxNegativeEntries )
+        this->negativeIndex.clear();
+
+    // rewrite if outdated, damaged or pruned
+    if ( version != CacheSystem::Version || this->negatives.size() != 1 + count * static_cast<qint64>( CacheSystem::NegativeRecordSize ) || count != this->negativeIndex.count()) {
+        QHash<StatKey, quint8>::const_iterator i;
+
+        this->negatives.resetStatus();
+        this->negatives.clear();
+        this->negatives.toStart();
+        this->negatives << CacheSystem::Version;
+        for ( i = this->negativeIndex.constBegin(); i != this->negativeIndex.constEnd(); ++i )
+            Storage::writeRecord( this->negatives, qMakePair( i.key(), i.value()));
+    }
+
+    // report
+    qDebug() << this->tr( "Cache::readNegatives: found %1 entries in negative store" ).arg( this->negativeIndex.count());
+}
+
+/**
+ * @brief Cache::reject remembers a file that yielded no cache entry
+ * @param key stat key of the file when it was hashed
+ * @param hash
+ * @param entry worker result
+ */
+void Cache::reject( const StatKey &key, const Hash &hash, const DataEntry &entry ) {
+    quint8 reason;
+
+    if ( !this->negatives.isOpen() || key == StatKey())
+        return;
+
+    if ( !key.size )
+        reason = CacheSystem::EmptyFile;
+    else if ( !hash.first || hash.second != key.size )
+        reason = CacheSystem::UnreadableFile;
+    else if ( entry.mimeType.isEmpty())
+        reason = CacheSystem::UnknownType;
+    else
+        return;
+
+    // chmod changes neither size nor mtime, so unreadable files are only
+    // remembered for this session (and while they stay unreadable, see resolve)
+    if ( reason == CacheSystem::UnreadableFile ) {
+        this->negativeIndex[key] = reason;
+        return;
+    }
+
+    // keyed by stat, so a modified file is looked at again (committed along with the next batch)
+    QDataStream negativeStream( &this->pendingNegatives, QIODevice::WriteOnly | QIODevice::Append );
+    Storage::writeRecord( negativeStream, qMakePair( key, reason ));
+    this->negativeIndex[key] = reason;
+}
+
+/**
+ * @brief Cache::rejected builds the entry of a known dead end
  * @param fileName
+ * @param key
+ * @return
  */
-void Cache::process( const QString &fileName ) {
-    if ( fileName.isEmpty() )
+DataEntry Cache::rejected( const QString &fileName, const StatKey &key ) const {
+    // what the worker would have found, without touching file contents
+    if ( this->negativeIndex.value( key ) == CacheSystem::EmptyFile )
+        return DataEntry( "application/x-zerosize" );
+
+    return DataEntry( QMimeDatabase().mimeTypeForFile( fileName, QMimeDatabase::MatchExtension ).name());
+}
+
+/**
+ * @brief Cache::readDirectories
+ */
+void Cache::readDirectories() {
+    quint8 version = 0;
+    int count = 0;
+
+    // keyed by content hashes, so it is tied to cache version
+    this->dirs.toStart();
+    if ( this->dirs.size())
+        this->dirs >> version;
+
+    if ( version != CacheSystem::Version ) {
+        this->writeDirectories();
         return;
+    }
+
+    // read records up to the first torn one, newer ones override older ones
+    while ( !this->dirs.atEnd()) {
+        QPair<Hash, quint32> record;
+
+        if ( !Storage::readRecord( this->dirs, record, CacheSystem::DirectoryRecordSize ))
+            break;
 
-    this->indexer->addWork( fileName );
+        this->directories[record.first] = record.second;
+        count++;
+    }
+
+    // rewrite if mostly stale records (moved files) or damaged
+    if ( count > 2 * this->directories.count() + 1024 || this->dirs.size() != 1 + count * static_cast<qint64>( CacheSystem::DirectoryRecordSize ))
+        this->writeDirectories();
+
+    // report
+    qDebug() << this->tr( "Cache::readDirectories: found %1 entries in directory map" ).arg( this->directories.count());
 }
 
 /**
- * @brief Cache::process
- * @param fileList
+ * @brief Cache::writeDirectories rewrites the directory map from memory
  */
-void Cache::process( const QStringList &fileList ) {
-    QStringList files;
+void Cache::writeDirectories() {
+    DirectoryMap::const_iterator i;
 
-    foreach ( QString fileName, fileList ) {
-        if ( !fileName.isEmpty())
-            files << fileName;
+    if ( !this->dirs.isOpen())
+        return;
+
+    this->dirs.resetStatus();
+    this->dirs.clear();
+    this->dirs.toStart();
+    this->dirs << CacheSystem::Version;
+    for ( i = this->directories.constBegin(); i != this->directories.constEnd(); ++i )
+        Storage::writeRecord( this->dirs, qMakePair( i.key(), i.value()));
+    this->dirs.sync();
+    this->pendingDirs.clear();
+}
+
+/**
+ * @brief Cache::readBundles
+ */
+void Cache::readBundles() {
+    QFile bundleFile( this->cacheDir.absolutePath() + "/" + CacheSystem::BundlesFilename );
+
+    // written by compaction only
+    this->bundles.clear();
+    if ( !bundleFile.open( QFile::ReadOnly ))
+        return;
+
+    QDataStream bundleStream( &bundleFile );
+    while ( !bundleStream.atEnd()) {
+        QPair<quint32, QPair<qint64, qint64> > record;
+
+        if ( !Storage::readRecord( bundleStream, record, CacheSystem::BundleRecordSize ))
+            break;
+
+        this->bundles[record.first] = record.second;
     }
+}
+
+/**
+ * @brief Cache::directoryId
+ * @param path directory path
+ * @return
+ */
+quint32 Cache::directoryId( const QString &path ) {
+    const QByteArray bytes( path.toUtf8());
+    const quint32 id = Checksum::crc32( bytes.constData(), static_cast<size_t>( bytes.size()));
 
-    std::reverse( files.begin(), files.end());
-    this->indexer->addWork( files );
+    // zero stands for unknown
+    return id ? id : 1;
 }
 
 /**
- * @brief Cache::stop
+ * @brief Cache::remember records the directory an entry was last seen in
+ * @param hash
+ * @param fileName
  */
-void Cache::stop() {
-    this->indexer->clear();
-    this->worker->clear();
+void Cache::remember( const Hash &hash, const QString &fileName ) {
+    const quint32 directory = Cache::directoryId( fileName.left( fileName.lastIndexOf( '/' )));
+
+    if ( !this->dirs.isOpen() || this->directories.value( hash ) == directory )
+        return;
+
+    // committed along with the next batch
+    QDataStream dirStream( &this->pendingDirs, QIODevice::WriteOnly | QIODevice::Append );
+    Storage::writeRecord( dirStream, qMakePair( hash, directory ));
+    this->directories[hash] = directory;
 }
 
 /**
- * @brief Cache::indexingDone
+ * @brief Cache::prefetch starts reading the bundle of a newly visited directory
  * @param fileName
  */
-void Cache::indexingDone( const QString &fileName, const Hash &hash ) {
-    if ( !this->contains( hash )) {
-        this->worker->addWork( Work( hash, fileName ));
-        //qDebug() << "Cache::indexingDone: uncached" << fileName;
+void Cache::prefetch( const QString &fileName ) {
+    const QString path( fileName.left( fileName.lastIndexOf( '/' )));
+    quint32 directory;
+
+    if ( !QString::compare( path, this->lastDirectory ))
         return;
+
+    this->lastDirectory = path;
+    directory = Cache::directoryId( path );
+    if ( this->bundles.contains( directory ))
+        this->data.advise( this->bundles[directory].first, this->bundles[directory].second );
+}
+
+/**
+ * @brief Cache::find
+ * @param hash
+ * @param entry
+ * @return
+ */
+bool Cache::find( const Hash &hash, IndexEntry &entry ) {
+    quint32 now;
+
+    // tail or already looked up, otherwise search index file
+    if ( this->damaged.contains( hash ))
+        return false;
+    else if ( this->hash.contains( hash ))
+        entry = this->hash[hash];
+    else if ( !this->search( hash, entry ))
+        return false;
+
+    // track access time (coarsely, each update is a tail record)
+    now = QDateTime::currentDateTime().toTime_t();
+    if ( now - entry.accessed > CacheSystem::AccessGranularity ) {
+        QDataStream tailStream( &this->pendingTail, QIODevice::WriteOnly | QIODevice::Append );
+
+        entry.accessed = now;
+        Storage::writeRecord( tailStream, entry );
+        this->pendingCount++;
+        this->tailCount++;
     }
 
-    // done
-    emit this->finished( fileName, this->cachedData( hash ));
+    // remember the result
+    this->hash[hash] = entry;
+    return true;
 }
 
 /**
- * @brief Cache::workDone
- * @param fileName
+ * @brief Cache::search
+ * @param hash
+ * @param entry
+ * @return
  */
-void Cache::workDone( const Work &work ) {
-    // cache to disk
-    this->write( work.hash.first, work.hash.second, work.data.mimeType, work.data.pixmapList );
+bool Cache::search( const Hash &hash, IndexEntry &entry ) const {
+    const uchar *records;
+    qint64 low, high, middle;
 
-    // done
-    emit this->finished( work.fileName, work.data );
+    if ( this->index.mapped() == nullptr || this->index.mappedSize() <= CacheSystem::IndexHeaderSize )
+        return false;
+
+    // binary search directly in the mapping
+    records = this->index.mapped() + CacheSystem::IndexHeaderSize;
+    low = 0;
+    high = ( this->index.mappedSize() - CacheSystem::IndexHeaderSize ) / CacheSystem::IndexRecordSize - 1;
+    while ( low <= high ) {
+        const uchar *record;
+        Hash current;
+
+        middle = low + ( high - low ) / 2;
+        record = records + middle * CacheSystem::IndexRecordSize;
+        current = Hash( qFromBigEndian<quint64>( record ), qFromBigEndian<qint64>( record + 8 ));
+
+        if ( current == hash ) {
+            entry = IndexEntry( current.first, current.second, qFromBigEndian<qint64>( record + 16 ), qFromBigEndian<quint32>( record + 24 ), qFromBigEndian<quint32>( record + 28 ));
+            return true;
+        }
+
+        if ( current < hash )
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Cache::mergeTail
+ */
+void Cache::mergeTail() {
+    // compaction rewrites the index anyway
+    if ( !this->isValid() || this->mergeWatcher.isRunning() || this->compactionWatcher.isRunning())
+        return;
+
+    // another instance is merging or compacting (released in mergeDone())
+    if ( !this->maintenanceLock.tryLock( 0 ))
+        return;
+
+    // records appended after this point are carried over in mergeDone()
+    if ( !this->lock()) {
+        this->maintenanceLock.unlock();
+        return;
+    }
+    this->flush();
+    this->tail.sync();
+    this->mergeSnapshot = this->tail.size();
+    this->unlock();
+    this->mergeWatcher.setFuture( QtConcurrent::run( &Cache::mergeIndex, this->cacheDir.absolutePath() + "/" + CacheSystem::IndexFilename, this->cacheDir.absolutePath() + "/" + CacheSystem::TailFilename, this->mergeSnapshot, this->cacheDir.absolutePath() + "/" + CacheSystem::IndexFilename + ".tmp" ));
+}
+
+/**
+ * @brief Cache::readTail
+ * @param tailFilename
+ * @param tailSize
+ * @return
+ */
+QList<IndexEntry> Cache::readTail( const QString &tailFilename, qint64 tailSize ) {
+    QFile tailFile( tailFilename );
+    QHash<Hash, IndexEntry> entries;
+    QList<IndexEntry> list;
+
+    if ( !tailFile.open( QFile::ReadOnly ))
+        return list;
+
+    // read tail snapshot, later records (access updates) override earlier ones
+    QDataStream tailStream( &tailFile );
+    while ( tailFile.pos() + CacheSystem::TailRecordSize <= tailSize ) {
+        IndexEntry tailEntry;
+
+        if ( !Storage::readRecord( tailStream, tailEntry, CacheSystem::TailRecordSize ))
+            break;
+
+        entries[Hash( tailEntry.hash, tailEntry.size )] = tailEntry;
+    }
+
+    // sort by hash
+    list = entries.values();
+    std::sort( list.begin(), list.end(), []( const IndexEntry &a, const IndexEntry &b ) { return Hash( a.hash, a.size ) < Hash( b.hash, b.size ); } );
+
+    return list;
+}
+
+/**
+ * @brief Cache::mergeIndex
+ * @param indexFilename
+ * @param tailFilename
+ * @param tailSize
+ * @param outFilename
+ * @return
+ */
+bool Cache::mergeIndex( const QString &indexFilename, const QString &tailFilename, qint64 tailSize, const QString &outFilename ) {
+    QFile indexFile( indexFilename ), outFile( outFilename );
+    QList<IndexEntry> tailList;
+    IndexEntry indexEntry;
+    HashPolicy policy;
+    bool hasEntry = false;
+    quint8 version;
+    int y = 0;
+
+    // runs in a separate thread with its own file handles
+    if ( !indexFile.open( QFile::ReadOnly ) || !outFile.open( QFile::WriteOnly | QFile::Truncate ))
+        return false;
+
+    QDataStream indexStream( &indexFile ), outStream( &outFile );
+
+    // read sorted tail snapshot
+    tailList = Cache::readTail( tailFilename, tailSize );
+
+    // copy header
+    indexStream >> version >> policy;
+    outStream << version << policy;
+
+    // merge both sorted sequences
+    forever {
+        if ( !hasEntry && !indexStream.atEnd()) {
+            indexStream >> indexEntry;
+            hasEntry = true;
+        }
+
+        if ( hasEntry && ( y >= tailList.count() || Hash( indexEntry.hash, indexEntry.size ) <= Hash( tailList.at( y ).hash, tailList.at( y ).size ))) {
+            // tail records are newer (access updates)
+            if ( y < tailList.count() && Hash( indexEntry.hash, indexEntry.size ) == Hash( tailList.at( y ).hash, tailList.at( y ).size )) {
+                indexEntry = tailList.at( y );
+                y++;
+            }
+
+            outStream << indexEntry;
+            hasEntry = false;
+        } else if ( y < tailList.count()) {
+            outStream << tailList.at( y );
+            y++;
+        } else {
+            break;
+        }
+    }
+
+    // must be on disk before it replaces the index file
+    return indexStream.status() == QDataStream::Ok && outStream.status() == QDataStream::Ok && FileStream::datasync( outFile );
+}
+
+/**
+ * @brief Cache::mergeDone
+ */
+void Cache::mergeDone() {
+    QList<IndexEntry> remaining;
+    QString indexFilename( this->cacheDir.absolutePath() + "/" + CacheSystem::IndexFilename );
+
+    if ( !this->isValid())
+        return;
+
+    if ( !this->mergeWatcher.result() || !this->lock()) {
+        qDebug() << this->tr( "Cache::mergeDone: failed to merge index tail" );
+        QFile::remove( indexFilename + ".tmp" );
+        this->maintenanceLock.unlock();
+        return;
+    }
+
+    // collect records appended during the merge (by any instance)
+    this->refresh();
+    this->tail.setPos( this->mergeSnapshot );
+    while ( !this->tail.atEnd()) {
+        IndexEntry indexEntry;
+
+        if ( !Storage::readRecord( this->tail, indexEntry, CacheSystem::TailRecordSize ))
+            break;
+
+        remaining << indexEntry;
+    }
+    this->tail.resetStatus();
+
+    // swap index files
+    this->index.close();
+    QFile::remove( indexFilename );
+    QFile::rename( indexFilename + ".tmp", indexFilename );
+    if ( !this->index.open() || this->index.map() == nullptr ) {
+        qDebug() << this->tr( "Cache::mergeDone: could not reopen index file" );
+        this->unlock();
+        this->shutdown();
+        return;
+    }
+
+    // restart tail
+    this->tail.clear();
+    this->tail.toStart();
+    foreach ( const IndexEntry &indexEntry, remaining )
+        Storage::writeRecord( this->tail, indexEntry );
+    this->tail.sync();
+    this->tailCount = remaining.count() + this->pendingCount;
+    this->tailPos = this->tail.size();
+    this->identify();
+    this->unlock();
+    this->maintenanceLock.unlock();
+
+    // report
+    qDebug() << this->tr( "Cache::mergeDone: merged tail into index file" );
+}
+
+/**
+ * @brief Cache::compact
+ */
+void Cache::compact() {
+    if ( !this->isValid() || this->sizeBudget() <= 0 || this->mergeWatcher.isRunning() || this->compactionWatcher.isRunning())
+        return;
+
+    // another instance is merging or compacting (released in compactionDone())
+    if ( !this->maintenanceLock.tryLock( 0 ))
+        return;
+
+    // entries written after this point are carried over in compactionDone()
+    if ( !this->lock()) {
+        this->maintenanceLock.unlock();
+        return;
+    }
+    this->flush();
+    this->tail.sync();
+    this->data.sync();
+    this->compactionSnapshot = this->tail.size();
+    this->compactionDataSnapshot = this->data.size();
+    this->unlock();
+
+    // report
+    qDebug() << this->tr( "Cache::compact: data file exceeds budget (%1 > %2 bytes), compacting" ).arg( this->compactionDataSnapshot ).arg( this->sizeBudget());
+
+    this->compactionWatcher.setFuture( QtConcurrent::run( &Cache::compactData, this->cacheDir.absolutePath(), this->compactionSnapshot, this->sizeBudget(), this->bundled ? this->directories : DirectoryMap()));
+}
+
+/**
+ * @brief Cache::compactData
+ * @param path
+ * @param tailSize
+ * @param budget
+ * @return
+ */
+bool Cache::compactData( const QString &path, qint64 tailSize, qint64 budget, const DirectoryMap &directories ) {
+    QFile indexFile( path + "/" + CacheSystem::IndexFilename ), dataFile( path + "/" + CacheSystem::DataFilename );
+    QFile outIndex( indexFile.fileName() + StorageSystem::CompactSuffix ), outData( dataFile.fileName() + StorageSystem::CompactSuffix );
+    QFile outBundles( path + "/" + CacheSystem::BundlesFilename + StorageSystem::CompactSuffix );
+    QHash<Hash, IndexEntry> entries;
+    QHash<quint32, quint32> recency;
+    BundleMap bundles;
+    BundleMap::const_iterator i;
+    QList<IndexEntry> list;
+    qint64 total = 0, target;
+    HashPolicy policy;
+    quint8 version;
+    int y;
+
+    // runs in a separate thread with its own file handles
+    if ( !indexFile.open( QFile::ReadOnly ) || !dataFile.open( QFile::ReadOnly ) || !outIndex.open( QFile::WriteOnly | QFile::Truncate ) || !outData.open( QFile::WriteOnly | QFile::Truncate ) || !outBundles.open( QFile::WriteOnly | QFile::Truncate ))
+        return false;
+
+    QDataStream indexStream( &indexFile ), outStream( &outIndex ), bundleStream( &outBundles );
+
+    // read all entries, tail records override index records
+    indexStream >> version >> policy;
+    while ( !indexStream.atEnd()) {
+        IndexEntry indexEntry;
+        indexStream >> indexEntry;
+        entries[Hash( indexEntry.hash, indexEntry.size )] = indexEntry;
+    }
+    foreach ( const IndexEntry &indexEntry, Cache::readTail( path + "/" + CacheSystem::TailFilename, tailSize ))
+        entries[Hash( indexEntry.hash, indexEntry.size )] = indexEntry;
+
+    // most recently accessed first
+    list = entries.values();
+    entries.clear();
+    std::sort( list.begin(), list.end(), []( const IndexEntry &a, const IndexEntry &b ) { return a.accessed > b.accessed; } );
+
+    // keep as many hot entries as fit in the target size
+    target = budget * CacheSystem::CompactionTarget / 100;
+    for ( y = 0; y < list.count(); y++ ) {
+        if ( !list.at( y ).length || total + list.at( y ).length > target )
+            break;
+
+        total += list.at( y ).length;
+    }
+    list = list.mid( 0, y );
+
+    // lay out entries of each directory contiguously (most recently used directories
+    // first, hot-first within), so that opening a directory reads a single bundle
+    if ( !directories.isEmpty()) {
+        foreach ( const IndexEntry &indexEntry, list ) {
+            const quint32 directory = directories.value( Hash( indexEntry.hash, indexEntry.size ));
+            recency[directory] = qMax( recency.value( directory ), indexEntry.accessed );
+        }
+
+        std::stable_sort( list.begin(), list.end(), [&directories, &recency]( const IndexEntry &a, const IndexEntry &b ) {
+            const quint32 da = directories.value( Hash( a.hash, a.size )), db = directories.value( Hash( b.hash, b.size ));
+
+            if ( da == db )
+                return false;
+
+            // unknown directory last
+            if ( !da || !db )
+                return da != 0;
+
+            if ( recency.value( da ) != recency.value( db ))
+                return recency.value( da ) > recency.value( db );
+
+            return da < db;
+        } );
+    }
+
+    // copy data in layout order
+    for ( y = 0; y < list.count(); y++ ) {
+        IndexEntry &indexEntry = list[y];
+        const quint32 directory = directories.value( Hash( indexEntry.hash, indexEntry.size ));
+        QByteArray buffer;
+
+        if ( !dataFile.seek( indexEntry.offset ))
+            return false;
+
+        buffer = dataFile.read( indexEntry.length );
+        if ( buffer.size() != static_cast<int>( indexEntry.length ))
+            return false;
+
+        indexEntry.offset = outData.pos();
+        if ( outData.write( buffer ) != buffer.size())
+            return false;
+
+        // extend bundle
+        if ( directory ) {
+            if ( !bundles.contains( directory ))
+                bundles[directory] = qMakePair( indexEntry.offset, static_cast<qint64>( 0 ));
+            bundles[directory].second = outData.pos() - bundles[directory].first;
+        }
+    }
+
+    // write bundles
+    for ( i = bundles.constBegin(); i != bundles.constEnd(); ++i )
+        Storage::writeRecord( bundleStream, qMakePair( i.key(), i.value()));
+
+    // write sorted index
+    std::sort( list.begin(), list.end(), []( const IndexEntry &a, const IndexEntry &b ) { return Hash( a.hash, a.size ) < Hash( b.hash, b.size ); } );
+    outStream << version << policy;
+    foreach ( const IndexEntry &indexEntry, list )
+        outStream << indexEntry;
+
+    // report
+    qDebug() << QObject::tr( "Cache::compactData: kept %1 entries (%2 bytes)" ).arg( list.count()).arg( total );
+
+    return outStream.status() == QDataStream::Ok && bundleStream.status() == QDataStream::Ok && FileStream::datasync( outIndex ) && FileStream::datasync( outData ) && outBundles.flush();
+}
+
+/**
+ * @brief Cache::compactionDone
+ */
+void Cache::compactionDone() {
+    QList<IndexEntry> carried;
+    QFile dataFile( this->cacheDir.absolutePath() + "/" + CacheSystem::DataFilename );
+    QFile outData( dataFile.fileName() + StorageSystem::CompactSuffix ), outTail( this->cacheDir.absolutePath() + "/" + CacheSystem::TailFilename + StorageSystem::CompactSuffix );
+    QFile marker( this->cacheDir.absolutePath() + "/" + CacheSystem::CompactionMarker );
+    qint64 delta;
+
+    if ( !this->isValid())
+        return;
+
+    if ( !this->compactionWatcher.result() || !this->lock()) {
+        qDebug() << this->tr( "Cache::compactionDone: compaction failed" );
+        Cache::commitCompaction( this->cacheDir.absolutePath());
+        this->maintenanceLock.unlock();
+        return;
+    }
+
+    // append data written during compaction (by any instance)
+    this->flush();
+    this->data.sync();
+    if ( !dataFile.open( QFile::ReadOnly ) || !outData.open( QFile::ReadWrite | QFile::Append ) || !outTail.open( QFile::WriteOnly | QFile::Truncate )) {
+        qDebug() << this->tr( "Cache::compactionDone: could not open compacted files" );
+        Cache::commitCompaction( this->cacheDir.absolutePath());
+        this->unlock();
+        this->maintenanceLock.unlock();
+        return;
+    }
+    delta = outData.size() - this->compactionDataSnapshot;
+    dataFile.seek( this->compactionDataSnapshot );
+    outData.write( dataFile.readAll());
+
+    // carry over their index records, access updates of older entries are
+    // dropped since they may point to evicted data
+    this->tail.setPos( this->compactionSnapshot );
+    while ( !this->tail.atEnd()) {
+        IndexEntry indexEntry;
+
+        if ( !Storage::readRecord( this->tail, indexEntry, CacheSystem::TailRecordSize ))
+            break;
+
+        if ( indexEntry.offset < this->compactionDataSnapshot )
+            continue;
+
+        indexEntry.offset += delta;
+        carried << indexEntry;
+    }
+    this->tail.resetStatus();
+
+    QDataStream tailStream( &outTail );
+    foreach ( const IndexEntry &indexEntry, carried )
+        Storage::writeRecord( tailStream, indexEntry );
+
+    // compacted files must be complete before the marker commits them
+    FileStream::datasync( outData );
+    FileStream::datasync( outTail );
+    outData.close();
+    outTail.close();
+    dataFile.close();
+
+    // all files are complete - from here on the swap is finished even if interrupted
+    marker.open( QFile::WriteOnly );
+    marker.close();
+
+    // swap files
+    this->index.close();
+    this->tail.close();
+    this->data.close();
+    Cache::commitCompaction( this->cacheDir.absolutePath());
+    if ( !this->index.open() || !this->tail.open() || !this->data.open() || this->index.map() == nullptr ) {
+        qDebug() << this->tr( "Cache::compactionDone: could not reopen cache files" );
+        this->unlock();
+        this->shutdown();
+        return;
+    }
+
+    // offsets have changed
+    this->hash.clear();
+    foreach ( const IndexEntry &indexEntry, carried )
+        this->hash[Hash( indexEntry.hash, indexEntry.size )] = indexEntry;
+    this->tailCount = carried.count();
+    this->tailPos = this->tail.size();
+    this->committed = this->data.size();
+    this->identify();
+    this->readBundles();
+
+    // forget directories of evicted entries
+    DirectoryMap::iterator i = this->directories.begin();
+    while ( i != this->directories.end()) {
+        IndexEntry indexEntry;
+
+        if ( this->hash.contains( i.key()) || this->search( i.key(), indexEntry ))
+            ++i;
+        else
+            i = this->directories.erase( i );
+    }
+    this->writeDirectories();
+    this->unlock();
+    this->maintenanceLock.unlock();
+
+    // the cache has turned over, entries still left in the old files are cold
+    if ( this->legacyData.isOpen() && !this->legacyWatcher.isRunning())
+        this->dropLegacy();
+
+    // report
+    qDebug() << this->tr( "Cache::compactionDone: data file compacted to %1 bytes" ).arg( this->data.size());
+}
+
+/**
+ * @brief Cache::commitCompaction
+ * @param path
+ */
+void Cache::commitCompaction( const QString &path ) {
+    Storage::commit( path, QStringList() << CacheSystem::IndexFilename << CacheSystem::TailFilename << CacheSystem::DataFilename << CacheSystem::BundlesFilename, CacheSystem::CompactionMarker );
+}
+
+/**
+ * @brief Cache::write
+ * @param hash
+ * @param size
+ * @param mimeType
+ * @param imageList
+ * @return
+ */
+bool Cache::write( const Hash &hash, const DataEntry &dataEntry ) {
+    // failsafe
+    if ( !this->isValid())
+        return false;
+
+    // check hash
+    if ( hash.first == 0 || hash.second == 0 || dataEntry.mimeType.length() == 0 ) {
+       // qDebug() << this->tr( "Cache::write: zero length hash, size or mimeType" );
+        return false;
+    }
+
+    // check for duplicates (damaged entries are replaced)
+    if ( this->contains( hash ))
+        return true;
+    this->damaged.remove( hash );
+
+    // create new data entry (buffered until the batch is flushed)
+    IndexEntry indexEntry( hash.first, hash.second, this->dataEnd(), 0, QDateTime::currentDateTime().toTime_t());
+    QByteArray payload;
+    QDataStream payloadStream( &payload, QIODevice::WriteOnly );
+    DataEntry entry( dataEntry );
+
+    // fresh entries are encoded as configured
+    if ( !entry.imageList.isEmpty()) {
+        entry.codec = this->m_codec;
+        entry.quality = this->m_quality;
+    }
+    payloadStream << entry;
+
+    // frame as length, crc32, payload
+    QDataStream dataStream( &this->pendingData, QIODevice::WriteOnly | QIODevice::Append );
+    Storage::writeFrame( dataStream, payload );
+    indexEntry.length = static_cast<quint32>( this->dataEnd() - indexEntry.offset );
+
+    // create new index entry (written on flush, once its final offset is known)
+    this->pendingEntries << indexEntry;
+    this->pendingCount++;
+    this->tailCount++;
+
+    // add new enty to list (pending entries are served from memory)
+    this->hash[Hash( indexEntry.hash, indexEntry.size )] = indexEntry;
+
+    // commit batch
+    if ( this->pendingCount >= CacheSystem::BatchEntries || this->pendingData.size() >= CacheSystem::BatchBytes )
+        this->flush();
+
+    // evict cold entries or fold tail into index file
+    if ( this->dataEnd() > this->sizeBudget())
+        this->compact();
+    else if ( this->tailCount >= CacheSystem::MaxTailEntries )
+        this->mergeTail();
+
+    // return success
+    return true;
+}
+
+/**
+ * @brief Cache::flush commits buffered entries with one write and one sync per file
+ */
+void Cache::flush() {
+    if ( !this->pendingCount && this->pendingDirs.isEmpty() && this->pendingPaths.isEmpty() && this->pendingNegatives.isEmpty())
+        return;
+
+    // appends of other instances would interleave - kept for the next batch if busy
+    if ( !this->lock())
+        return;
+
+    // batch goes to the current end of the data file
+    this->refresh();
+
+    // accelerators, no need to sync
+    if ( !this->pendingDirs.isEmpty() && this->dirs.isOpen()) {
+        this->dirs.seek( FileStream::End );
+        this->dirs.writeRawData( this->pendingDirs.constData(), this->pendingDirs.size());
+        this->dirs.sync();
+        this->pendingDirs.clear();
+    }
+
+    if ( !this->pendingPaths.isEmpty() && this->paths.isOpen()) {
+        this->paths.seek( FileStream::End );
+        this->paths.writeRawData( this->pendingPaths.constData(), this->pendingPaths.size());
+        this->paths.sync();
+        this->pendingPaths.clear();
+    }
+
+    if ( !this->pendingNegatives.isEmpty() && this->negatives.isOpen()) {
+        this->negatives.seek( FileStream::End );
+        this->negatives.writeRawData( this->pendingNegatives.constData(), this->pendingNegatives.size());
+        this->negatives.sync();
+        this->pendingNegatives.clear();
+    }
+
+    if ( !this->pendingCount || !this->data.isOpen() || !this->tail.isOpen()) {
+        this->unlock();
+        return;
+    }
+
+    // data first, so that durable records never point past the data file
+    if ( !this->pendingData.isEmpty()) {
+        this->data.seek( FileStream::End );
+        this->data.writeRawData( this->pendingData.constData(), this->pendingData.size());
+        if ( !this->data.datasync())
+            qDebug() << this->tr( "Cache::flush: could not sync data file" );
+    }
+
+    QDataStream tailStream( &this->pendingTail, QIODevice::WriteOnly | QIODevice::Append );
+    foreach ( const IndexEntry &indexEntry, this->pendingEntries )
+        Storage::writeRecord( tailStream, indexEntry );
+
+    this->tail.seek( FileStream::End );
+    this->tail.writeRawData( this->pendingTail.constData(), this->pendingTail.size());
+    if ( !this->tail.datasync())
+        qDebug() << this->tr( "Cache::flush: could not sync tail file" );
+
+    // own records need not be read back
+    this->committed = this->data.size();
+    this->tailPos = this->tail.size();
+
+    this->batchCount++;
+    this->batchedCount += static_cast<quint64>( this->pendingCount );
+    this->pendingData.clear();
+    this->pendingTail.clear();
+    this->pendingEntries.clear();
+    this->pendingCount = 0;
+    this->unlock();
+}
+
+/**
+ * @brief Cache::identify remembers which files are open (merges and compactions replace them)
+ */
+void Cache::identify() {
+    Storage::statKey( this->cacheDir.absolutePath() + "/" + CacheSystem::IndexFilename, this->indexKey );
+    Storage::statKey( this->cacheDir.absolutePath() + "/" + CacheSystem::DataFilename, this->dataKey );
+}
+
+/**
+ * @brief Cache::refresh picks up entries appended (or files swapped) by other instances
+ */
+void Cache::refresh() {
+    // never waits, the next poll will do
+    if ( !this->isValid() || !this->lock( 0 ))
+        return;
+
+    // merged or compacted by another instance
+    if ( Storage::replaced( this->cacheDir.absolutePath() + "/" + CacheSystem::IndexFilename, this->indexKey ) || Storage::replaced( this->cacheDir.absolutePath() + "/" + CacheSystem::DataFilename, this->dataKey )) {
+        if ( !this->reopen()) {
+            qDebug() << this->tr( "Cache::refresh: could not reopen cache files" );
+            this->setValid( false );
+            this->unlock();
+            return;
+        }
+    }
+
+    // tail records of other instances (own ones are skipped in flush)
+    this->tail.setPos( this->tailPos );
+    while ( !this->tail.atEnd()) {
+        IndexEntry indexEntry;
+
+        if ( !Storage::readRecord( this->tail, indexEntry, CacheSystem::TailRecordSize ))
+            break;
+
+        this->hash[Hash( indexEntry.hash, indexEntry.size )] = indexEntry;
+        this->damaged.remove( Hash( indexEntry.hash, indexEntry.size ));
+        this->tailPos += CacheSystem::TailRecordSize;
+        this->tailCount++;
+    }
+    this->tail.resetStatus();
+
+    // unflushed entries move past data of other instances
+    this->rebase( this->data.size());
+    this->unlock();
+}
+
+/**
+ * @brief Cache::reopen switches to files swapped in by another instance
+ * @return
+ */
+bool Cache::reopen() {
+    this->index.close();
+    this->tail.close();
+    this->data.close();
+    if ( !this->index.open() || !this->tail.open() || !this->data.open() || this->index.map() == nullptr )
+        return false;
+
+    // offsets have changed, access updates point into the old files
+    this->hash.clear();
+    this->damaged.clear();
+    this->pendingTail.clear();
+    this->pendingCount = this->pendingEntries.count();
+    this->tailPos = 0;
+    this->tailCount = this->pendingCount;
+    this->readBundles();
+    this->identify();
+
+    // report
+    qDebug() << this->tr( "Cache::reopen: cache files replaced by another instance" );
+    return true;
+}
+
+/**
+ * @brief Cache::rebase moves unflushed entries to a new end of the data file
+ * @param size
+ */
+void Cache::rebase( qint64 size ) {
+    const qint64 delta = size - this->committed;
+    int y;
+
+    // served from memory until flushed
+    for ( y = 0; y < this->pendingEntries.count(); y++ ) {
+        this->pendingEntries[y].offset += delta;
+        this->hash[Hash( this->pendingEntries.at( y ).hash, this->pendingEntries.at( y ).size )] = this->pendingEntries.at( y );
+    }
+
+    this->committed = size;
+}
+
+/**
+ * @brief Cache::cachedData looks up several entries at once
+ * @param hashList
+ * @return entries in the order of hashList (empty if not cached)
+ */
+QList<DataEntry> Cache::cachedData( const QList<Hash> &hashList ) {
+    QList<DataEntry> entryList;
+    QList<QPair<IndexEntry, int> > reads;
+    QElapsedTimer timer;
+    QByteArray span;
+    int y, k, z;
+
+    timer.start();
+    for ( y = 0; y < hashList.count(); y++ ) {
+        IndexEntry indexEntry;
+
+        entryList << DataEntry();
+        if ( !this->isValid() || !this->find( hashList.at( y ), indexEntry ))
+            continue;
+
+        // recently read - no disk access or decoding at all
+        if ( this->hot.contains( hashList.at( y ))) {
+            this->hotHits++;
+            entryList[y] = *this->hot.object( hashList.at( y ));
+            continue;
+        }
+        this->hotMisses++;
+        reads << qMakePair( indexEntry, y );
+    }
+
+    if ( reads.isEmpty()) {
+        this->commitAccess();
+        return entryList;
+    }
+
+    // read in data file order - one forward sweep instead of random seeks
+    std::sort( reads.begin(), reads.end(), []( const QPair<IndexEntry, int> &a, const QPair<IndexEntry, int> &b ) {
+        return a.first.offset < b.first.offset;
+    } );
+
+    for ( y = 0; y < reads.count(); y = k ) {
+        const IndexEntry &first = reads.at( y ).first;
+        qint64 end = first.offset + first.length;
+
+        // mapped read - views are only valid until the next remap, yet entries
+        // are passed on to another thread, so levels are detached in admit()
+        // NOTE: entries of an unflushed batch are always viewed from memory
+        if ( this->readMode() == MappedRead || first.offset >= this->committed ) {
+            DataEntry entry;
+
+            k = y + 1;
+            entryList[reads.at( y ).second] = this->admit( first, entry, this->view( first, entry )) ? entry : DataEntry();
+            continue;
+        }
+
+        // frames close to each other share a single read
+        for ( k = y + 1; k < reads.count(); k++ ) {
+            const IndexEntry &next = reads.at( k ).first;
+
+            if ( next.offset - end > CacheSystem::ReadGap || next.offset + next.length - first.offset > CacheSystem::MaxReadSpan || next.offset + next.length > this->committed )
+                break;
+
+            end = qMax( end, next.offset + next.length );
+        }
+
+        span.resize( static_cast<int>( end - first.offset ));
+        const bool ok = this->data.setPos( first.offset ) && this->data.readRawData( span.data(), span.size()) == span.size();
+        this->data.resetStatus();
+
+        for ( z = y; z < k; z++ ) {
+            const IndexEntry &indexEntry = reads.at( z ).first;
+            DataEntry entry;
+
+            entryList[reads.at( z ).second] = this->admit( indexEntry, entry, ok && Cache::parse( QByteArray::fromRawData( span.constData() + ( indexEntry.offset - first.offset ), static_cast<int>( indexEntry.length )), entry )) ? entry : DataEntry();
+        }
+    }
+
+    this->readCount += static_cast<quint64>( reads.count());
+    this->readTime += static_cast<quint64>( timer.nsecsElapsed());
+    this->commitAccess();
+
+    return entryList;
+}
+
+/**
+ * @brief Cache::commitAccess flushes access-time records once a full batch has built up
+ *
+ * called after a lookup is done, never from find(): a flush may reopen files swapped
+ * in by another instance, invalidating the index entries held by the caller
+ */
+void Cache::commitAccess() {
+    // browsing alone fills batches too
+    if ( this->pendingCount >= CacheSystem::BatchEntries || this->pendingData.size() >= CacheSystem::BatchBytes )
+        this->flush();
+}
+
+/**
+ * @brief Cache::admit detaches and decodes a freshly read entry and keeps it in the hot tier
+ * @param indexEntry
+ * @param entry
+ * @param ok false if the frame was torn or corrupted
+ * @return
+ */
+bool Cache::admit( const IndexEntry &indexEntry, DataEntry &entry, bool ok ) {
+    const Hash hash( indexEntry.hash, indexEntry.size );
+    int cost, count;
+
+    // torn or corrupted - regenerate on next visit
+    if ( !ok ) {
+        qDebug() << this->tr( "Cache::admit: damaged entry at offset %1" ).arg( indexEntry.offset );
+        this->hash.remove( hash );
+        this->damaged << hash;
+        return false;
+    }
+
+    // encoded level is a view into a mapping or a read buffer (kept for packs, never re-encoded)
+    entry.encoded = QByteArray( entry.encoded.constData(), entry.encoded.size());
+
+    // decode here, once, instead of on the gui thread on every hit
+    if ( !entry.decode()) {
+        qDebug() << this->tr( "Cache::admit: undecodable entry at offset %1" ).arg( indexEntry.offset );
+        this->hash.remove( hash );
+        this->damaged << hash;
+        return false;
+    }
+
+    // charged by what it holds in memory
+    cost = entry.mimeType.size() * 2 + entry.encoded.size();
+    foreach ( const QImage &image, entry.imageList )
+        cost += image.byteCount();
+
+    // keep for re-scrolls (copies share the decoded levels)
+    count = this->hot.count();
+    if ( this->hot.insert( hash, new DataEntry( entry ), cost ))
+        this->hotEvictions += static_cast<quint64>( count + 1 - this->hot.count());
+
+    return true;
+}
+
+/**
+ * @brief Cache::view
+ * @param indexEntry
+ * @param entry
+ * @return
+ */
+bool Cache::view( const IndexEntry &indexEntry, DataEntry &entry ) {
+    QByteArray frame;
+
+    if ( indexEntry.offset >= this->committed ) {
+        // not flushed yet
+        if ( indexEntry.offset + indexEntry.length > this->dataEnd())
+            return false;
+
+        frame = QByteArray::fromRawData( this->pendingData.constData() + ( indexEntry.offset - this->committed ), static_cast<int>( indexEntry.length ));
+    } else {
+        // data file only grows by appending in flush() (of any instance), so an existing mapping
+        // stays valid for older entries; remap only when the entry lies beyond it
+        if ( this->data.mapped() == nullptr || indexEntry.offset + indexEntry.length > this->data.mappedSize()) {
+            if ( this->data.map() == nullptr )
+                return false;
+
+            if ( indexEntry.offset + indexEntry.length > this->data.mappedSize())
+                return false;
+        }
+
+        // wrap the mapping without copying
+        frame = QByteArray::fromRawData( reinterpret_cast<const char *>( this->data.mapped()) + indexEntry.offset, static_cast<int>( indexEntry.length ));
+    }
+
+    return Cache::parse( frame, entry );
+}
+
+/**
+ * @brief Cache::parse verifies a data frame and reads its entry (encoded level is a view into the frame)
+ * @param frame
+ * @param entry
+ * @return
+ */
+bool Cache::parse( const QByteArray &frame, DataEntry &entry ) {
+    QByteArray buffer;
+    quint32 length;
+    qint64 pos;
+
+    // check frame
+    if ( !Storage::readFrame( frame, buffer ))
+        return false;
+
+    QDataStream stream( buffer );
+
+    // read mimetype, level count, codec and length of the encoded level
+    stream >> entry.mimeType >> entry.levels >> entry.codec >> length;
+    if ( stream.status() != QDataStream::Ok )
+        return false;
+
+    // null byte array
+    if ( length == 0xffffffff )
+        return true;
+
+    // hand out a view of the encoded level
+    pos = stream.device()->pos();
+    if ( pos + length > buffer.size())
+        return false;
+
+    entry.encoded = QByteArray::fromRawData( buffer.constData() + pos, static_cast<int>( length ));
+    return true;
+}
+
+/**
+ * @brief Cache::setReadMode
+ * @param mode
+ */
+void Cache::setReadMode( ReadModes mode ) {
+    this->m_readMode = mode;
+
+    if ( mode == StreamRead )
+        this->data.unmap();
+}
+
+/**
+ * @brief DataEntry::image
+ * @param level
+ * @return premultiplied image
+ */
+QImage DataEntry::image( int level ) const {
+    QImage image;
+
+    if ( level < 0 || level >= this->count())
+        return QImage();
+
+    // freshly generated or decoded in Cache::admit
+    if ( !this->imageList.isEmpty())
+        return this->imageList.at( level );
+
+    // not decoded yet - decode the largest level, derive smaller ones
+    image = Codec::decode( this->encoded, static_cast<Codec::Codecs>( this->codec ));
+    if ( image.isNull())
+        return image;
+
+    image = image.convertToFormat( QImage::Format_ARGB32_Premultiplied );
+    if ( level > 0 && level < CacheSystem::NumPixmapLevels )
+        image = image.scaled( CacheSystem::PixmapLevels[level], CacheSystem::PixmapLevels[level], Qt::IgnoreAspectRatio, Qt::SmoothTransformation );
+
+    return image;
+}
+
+/**
+ * @brief DataEntry::decode fills the image levels from the encoded level
+ * @return false if the encoded level cannot be decoded
+ */
+bool DataEntry::decode() {
+    QImage image;
+    int y;
+
+    // freshly generated or nothing to decode
+    if ( !this->imageList.isEmpty() || this->encoded.isEmpty())
+        return true;
+
+    // decode the largest level, derive smaller ones
+    image = Codec::decode( this->encoded, static_cast<Codec::Codecs>( this->codec ));
+    if ( image.isNull())
+        return false;
+
+    image = image.convertToFormat( QImage::Format_ARGB32_Premultiplied );
+    for ( y = 0; y < this->levels; y++ ) {
+        if ( y > 0 && y < CacheSystem::NumPixmapLevels )
+            this->imageList << image.scaled( CacheSystem::PixmapLevels[y], CacheSystem::PixmapLevels[y], Qt::IgnoreAspectRatio, Qt::SmoothTransformation );
+        else
+            this->imageList << image;
+    }
+
+    return true;
+}
+
+/**
+ * @brief DataEntry::encode
+ * @param codec requested codec (set to the one actually used)
+ * @return largest level
+ */
+QByteArray DataEntry::encode( Codec::Codecs &codec ) const {
+    // already encoded (read entries carry their decoded levels as well)
+    if ( !this->encoded.isEmpty() || this->imageList.isEmpty()) {
+        codec = static_cast<Codec::Codecs>( this->codec );
+        return this->encoded;
+    }
+
+    if ( this->imageList.first().isNull())
+        return QByteArray();
+
+    return Codec::encode( this->imageList.first(), codec, this->quality );
+}
+
+/**
+ * @brief Cache::finishMaintenance waits for a running merge, compaction or legacy read and applies it
+ *        (for callers without an event loop, where the watchers' finished() would never arrive)
+ */
+void Cache::finishMaintenance() {
+    // finished() is posted to this thread by the time waitForFinished() returns
+    this->mergeWatcher.waitForFinished();
+    QCoreApplication::sendPostedEvents( &this->mergeWatcher );
+    this->compactionWatcher.waitForFinished();
+    QCoreApplication::sendPostedEvents( &this->compactionWatcher );
+    this->legacyWatcher.waitForFinished();
+    QCoreApplication::sendPostedEvents( &this->legacyWatcher );
+}
+
+/**
+ * @brief Cache::exportPack writes entries of all files under a directory to a pack (uncached ones are generated)
+ * @param path directory
+ * @param fileName pack
+ * @return number of entries exported, -1 on failure
+ */
+int Cache::exportPack( const QString &path, const QString &fileName ) {
+    QDirIterator it( path, QDir::Files | QDir::Hidden | QDir::NoDotAndDotDot, QDirIterator::Subdirectories );
+    QFile pack( fileName );
+    QSet<Hash> exported;
+    Indexer indexer( this->hashPolicy());
+    int generated = 0;
+
+    if ( !this->isValid() || !QFileInfo( path ).isDir() || !pack.open( QFile::WriteOnly | QFile::Truncate )) {
+        qDebug() << this->tr( "Cache::exportPack: could not export \"%1\" to \"%2\"" ).arg( path ).arg( fileName );
+        return -1;
+    }
+
+    // there is no event loop here, leftovers of read() are applied right away
+    this->finishMaintenance();
+
+    // entries are only of use to caches of the same layout and hash policy
+    QDataStream packStream( &pack );
+    packStream << CacheSystem::PackMagic << CacheSystem::Version << this->hashPolicy();
+
+    while ( it.hasNext()) {
+        const QString file( it.next());
+        QByteArray payload;
+        DataEntry entry;
+        quint32 legacy;
+        StatKey key;
+        Hash hash;
+        QSharedPointer<SourceBuffer> source;
+
+        // unchanged files need not be read
+        if ( Storage::statKey( file, key ) && this->pathIndex.contains( key ))
+            hash = Hash( this->pathIndex[key], key.size );
+        else
+            hash = indexer.work( file, legacy, WorkToken(), &source );
+
+        if ( !hash.first || exported.contains( hash ))
+            continue;
+
+        // not cached yet - generated here once instead of on every machine
+        entry = this->cachedData( hash );
+        if ( entry.mimeType.isEmpty()) {
+            if ( !this->write( hash, Worker::work( file, WorkToken(), source.isNull() ? QByteArray() : source->bytes )))
+                continue;
+
+            this->finishMaintenance();
+            entry = this->cachedData( hash );
+            generated++;
+        }
+
+        // frame as length, crc32, ( hash, entry )
+        QDataStream payloadStream( &payload, QIODevice::WriteOnly );
+        payloadStream << hash.first << hash.second << entry;
+        Storage::writeFrame( packStream, payload );
+        exported << hash;
+    }
+
+    this->flush();
+
+    // report
+    qDebug() << this->tr( "Cache::exportPack: exported %1 entries (%2 generated) to \"%3\"" ).arg( exported.count()).arg( generated ).arg( fileName );
+
+    return packStream.status() == QDataStream::Ok && pack.flush() ? exported.count() : -1;
+}
+
+/**
+ * @brief Cache::importPack merges entries of a pack into the cache
+ * @param fileName pack
+ * @return number of entries imported, -1 on failure
+ */
+int Cache::importPack( const QString &fileName ) {
+    QFile pack( fileName );
+    HashPolicy policy;
+    quint32 magic = 0;
+    quint8 version = 0;
+    int imported = 0, skipped = 0;
+
+    if ( !this->isValid() || !pack.open( QFile::ReadOnly )) {
+        qDebug() << this->tr( "Cache::importPack: could not open \"%1\"" ).arg( fileName );
+        return -1;
+    }
+
+    // check header
+    QDataStream packStream( &pack );
+    packStream >> magic >> version >> policy;
+    if ( packStream.status() != QDataStream::Ok || magic != CacheSystem::PackMagic || version != CacheSystem::Version ) {
+        qDebug() << this->tr( "Cache::importPack: \"%1\" is not a pack of cache version %2" ).arg( fileName ).arg( CacheSystem::Version );
+        return -1;
+    }
+
+    // there is no event loop here, leftovers of read() are applied right away
+    this->finishMaintenance();
+
+    // read frames up to the first torn or corrupted one
+    while ( !packStream.atEnd()) {
+        QByteArray frame( StorageSystem::FrameHeaderSize, Qt::Uninitialized ), payload;
+        DataEntry entry;
+        quint32 length;
+        Hash hash;
+
+        if ( packStream.readRawData( frame.data(), frame.size()) != frame.size())
+            break;
+
+        length = qFromBigEndian<quint32>( reinterpret_cast<const uchar *>( frame.constData()));
+        if ( length > static_cast<quint32>( StorageSystem::BatchBytes ))
+            break;
+
+        frame.resize( StorageSystem::FrameHeaderSize + static_cast<int>( length ));
+        if ( packStream.readRawData( frame.data() + StorageSystem::FrameHeaderSize, static_cast<int>( length )) != static_cast<int>( length ) || !Storage::readFrame( frame, payload ))
+            break;
+
+        QDataStream payloadStream( payload );
+        payloadStream >> hash.first >> hash.second >> entry;
+        if ( payloadStream.status() != QDataStream::Ok )
+            break;
+
+        // sampled hashes depend on the policy, full ones do not
+        if ( !( policy == this->hashPolicy()) && ( policy.sampled( hash.second ) || this->hashPolicy().sampled( hash.second ))) {
+            skipped++;
+            continue;
+        }
+
+        // already cached
+        if ( this->contains( hash )) {
+            skipped++;
+            continue;
+        }
+
+        // written as is, without decoding
+        if ( this->write( hash, entry ))
+            imported++;
+
+        this->finishMaintenance();
+    }
+
+    this->flush();
+
+    // report
+    if ( !packStream.atEnd())
+        qDebug() << this->tr( "Cache::importPack: \"%1\" is damaged at offset %2" ).arg( fileName ).arg( pack.pos());
+    qDebug() << this->tr( "Cache::importPack: imported %1 entries, skipped %2" ).arg( imported ).arg( skipped );
+
+    return imported;
+}
+
+/**
+ * @brief Cache::shutdown
+ */
+void Cache::shutdown() {
+    // report
+    if ( this->readCount )
+        qDebug() << this->tr( "Cache::shutdown: %1 reads, %2 us per read (%3)" ).arg( this->readCount ).arg( this->readTime / this->readCount / 1000.0 ).arg( this->readMode() == MappedRead ? "mapped" : "stream" );
+    if ( this->hotHits + this->hotMisses )
+        qDebug() << this->tr( "Cache::shutdown: hot tier %1 hits, %2 misses, %3 evictions" ).arg( this->hotHits ).arg( this->hotMisses ).arg( this->hotEvictions );
+    if ( this->viewportCount )
+        qDebug() << this->tr( "Cache::shutdown: %1 viewports delivered, %2 ms on average, %3 ms worst, %4 scrolled past" ).arg( this->viewportCount ).arg( this->viewportTime / this->viewportCount / 1000000.0, 0, 'f', 1 ).arg( this->viewportWorst / 1000000.0, 0, 'f', 1 ).arg( this->viewportDropped );
+    if ( SourceBuffer::bytesRead())
+        qDebug() << this->tr( "Cache::shutdown: %1 MB read from source files" ).arg( SourceBuffer::bytesRead() / 1048576.0, 0, 'f', 1 );
+
+    // commit the last batch
+    this->flush();
+    if ( this->batchCount )
+        qDebug() << this->tr( "Cache::shutdown: %1 entries written in %2 batches" ).arg( this->batchedCount ).arg( this->batchCount );
+
+    this->setValid( false );
+    this->mergeWatcher.waitForFinished();
+    this->compactionWatcher.waitForFinished();
+    this->legacyWatcher.waitForFinished();
+    this->legacyData.close();
+    this->index.close();
+    this->tail.close();
+    this->data.close();
+    this->paths.close();
+    this->negatives.close();
+    this->dirs.close();
+
+    // let other instances in
+    this->maintenanceLock.unlock();
+    this->writerLock.release();
+
+    // stop all first, then wait
+    foreach ( Indexer *indexer, this->indexers )
+        indexer->interrupt();
+    foreach ( Worker *worker, this->workers )
+        worker->interrupt();
+    foreach ( Indexer *indexer, this->indexers )
+        indexer->wait();
+    foreach ( Worker *worker, this->workers )
+        worker->wait();
+    this->indexers.clear();
+    this->workers.clear();
+}
+
+/**
+ * @brief Cache::process
+ * @param fileName
+ */
+void Cache::process( const QString &fileName ) {
+    StatKey key;
+    Hash hash;
+
+    if ( fileName.isEmpty())
+        return;
+
+    this->poll();
+    this->prefetch( fileName );
+    if ( this->resolve( fileName, key, hash )) {
+        // known dead end
+        if ( !hash.first ) {
+            this->pendingKeys.remove( fileName );
+            this->deliver( fileName, this->rejected( fileName, key ));
+            this->flushResults();
+            return;
+        }
+
+        const DataEntry entry( this->cachedData( hash ));
+
+        // damaged entries go through the regular path
+        if ( !entry.mimeType.isEmpty()) {
+            this->pendingKeys.remove( fileName );
+            this->remember( hash, fileName );
+            this->deliver( fileName, entry );
+            this->flushResults();
+            return;
+        }
+    }
+
+    // already in line
+    if ( this->queued.contains( fileName ))
+        return;
+
+    this->queued[fileName] = 0;
+    this->indexPool.schedule( Work( Hash(), fileName, DataEntry(), StatKey(), this->generation.load()), 0 );
+}
+
+/**
+ * @brief Cache::process resolves a batch of files, cached ones are read in a single sweep
+ * @param fileList files on screen, closest to the viewport center first
+ */
+void Cache::process( const QStringList &fileList ) {
+    QStringList files, hits;
+    QList<StatKey> keyList;
+    QList<Hash> hashList;
+    QList<DataEntry> entryList;
+    QList<Work> jobs;
+    QList<int> priorities;
+    QHash<QString, int> ranks;
+    int y;
+
+    // position in the list is the priority
+    for ( y = fileList.count() - 1; y >= 0; y-- )
+        ranks[fileList.at( y )] = y;
+
+    // time the new viewport until all of it is delivered (scrolled past otherwise)
+    if ( !this->viewportPending.isEmpty())
+        this->viewportDropped++;
+    this->viewportPending = fileList.toSet();
+    this->viewportPending.remove( QString());
+    this->viewportTimer.start();
+
+    // entries of other instances
+    this->poll();
+
+    // resolve index hits first
+    foreach ( const QString &fileName, fileList ) {
+        StatKey key;
+        Hash hash;
+
+        if ( fileName.isEmpty())
+            continue;
+
+        this->prefetch( fileName );
+        if ( this->resolve( fileName, key, hash )) {
+            hits << fileName;
+            keyList << key;
+            hashList << hash;
+        } else {
+            files << fileName;
+        }
+    }
+
+    // then read them in data file order
+    entryList = this->cachedData( hashList );
+    for ( y = hits.count() - 1; y >= 0; y-- ) {
+        // known dead end
+        if ( !hashList.at( y ).first ) {
+            entryList[y] = this->rejected( hits.at( y ), keyList.at( y ));
+            this->pendingKeys.remove( hits.at( y ));
+            continue;
+        }
+
+        // damaged entries go through the regular path
+        if ( entryList.at( y ).mimeType.isEmpty()) {
+            files << hits.takeAt( y );
+            entryList.removeAt( y );
+            continue;
+        }
+
+        this->pendingKeys.remove( hits.at( y ));
+        this->remember( hashList.at( y ), hits.at( y ));
+    }
+
+    // deliver all hits at once (along with results still waiting for the next frame)
+    if ( !hits.isEmpty()) {
+        this->resultFiles << hits;
+        this->resultEntries << entryList;
+        this->flushResults();
+    }
+
+    // files that are already in line are just reprioritized, those that left the screen go last
+    this->reprioritize( ranks );
+    for ( y = files.count() - 1; y >= 0; y-- ) {
+        if ( this->queued.contains( files.at( y ))) {
+            files.removeAt( y );
+            continue;
+        }
+
+        this->queued[files.at( y )] = ranks.value( files.at( y ));
+    }
+
+    foreach ( const QString &fileName, files ) {
+        jobs << Work( Hash(), fileName, DataEntry(), StatKey(), this->generation.load());
+        priorities << ranks.value( fileName );
+    }
+    this->indexPool.schedule( jobs, priorities );
+}
+
+/**
+ * @brief Cache::reprioritize reorders files being hashed or decoded by their new rank
+ * @param ranks
+ */
+void Cache::reprioritize( const QHash<QString, int> &ranks ) {
+    QHash<QString, int>::iterator i;
+
+    if ( this->queued.isEmpty())
+        return;
+
+    for ( i = this->queued.begin(); i != this->queued.end(); ++i )
+        i.value() = ranks.value( i.key(), WorkSystem::Unranked );
+
+    this->indexPool.reprioritize( ranks, []( const Work &work ) { return work.fileName; } );
+    this->workPool.reprioritize( ranks, []( const Work &work ) { return work.fileName; } );
+}
+
+/**
+ * @brief Cache::resolve looks up an unchanged file in the path index
+ * @param fileName
+ * @param key stat key of the file
+ * @param hash content hash, if resolved (zero for known dead ends)
+ * @return true if the content is cached or known to have no entry
+ */
+bool Cache::resolve( const QString &fileName, StatKey &key, Hash &hash ) {
+    if ( !Storage::statKey( fileName, key ))
+        return false;
+
+    // checked against in indexingDone()
+    this->pendingKeys[fileName] = key;
+
+    // access granted since
+    if ( this->negativeIndex.value( key, CacheSystem::EmptyFile ) == CacheSystem::UnreadableFile && QFileInfo( fileName ).isReadable())
+        this->negativeIndex.remove( key );
+
+    // neither hashed nor sniffed again until modified
+    if ( this->negativeIndex.contains( key )) {
+        hash = Hash();
+        return true;
+    }
+
+    // unchanged since the last visit - no need to read the file
+    if ( !this->pathIndex.contains( key ))
+        return false;
+
+    hash = Hash( this->pathIndex[key], key.size );
+    return this->contains( hash );
+}
+
+/**
+ * @brief Cache::stop drops queued jobs and cancels running ones
+ */
+void Cache::stop() {
+    this->generation.ref();
+    this->indexPool.clear();
+    this->workPool.clear();
+    this->pendingKeys.clear();
+    this->queued.clear();
+
+    // results of the directory we left
+    if ( !this->viewportPending.isEmpty())
+        this->viewportDropped++;
+    this->viewportPending.clear();
+    this->resultTimer.stop();
+    this->resultFiles.clear();
+    this->resultEntries.clear();
+}
+
+/**
+ * @brief Cache::indexingDone
+ * @param work
+ * @param legacy
+ */
+void Cache::indexingDone( const Work &work, quint32 legacy ) {
+    const QString fileName( work.fileName );
+    const Hash hash( work.hash );
+    StatKey key;
+
+    // finished just as we navigated away
+    if ( work.generation != this->generation.load()) {
+        Indexer::release( fileName );
+        return;
+    }
+
+    // remember hash, unless the file was modified while being hashed
+    if ( this->pendingKeys.contains( fileName )) {
+        const StatKey pending( this->pendingKeys.take( fileName ));
+
+        if ( Storage::statKey( fileName, key ) && key == pending ) {
+            if ( hash.first != 0 && key.size == hash.second && this->paths.isOpen()) {
+                QDataStream pathStream( &this->pendingPaths, QIODevice::WriteOnly | QIODevice::Append );
+
+                // committed along with the next batch
+                Storage::writeRecord( pathStream, qMakePair( key, hash.first ));
+                this->pathIndex[key] = hash.first;
+            }
+        } else {
+            // worker results are not remembered either
+            key = StatKey();
+        }
+    }
+
+    if ( this->contains( hash )) {
+        const DataEntry entry( this->cachedData( hash ));
+
+        if ( !entry.mimeType.isEmpty()) {
+            // thumbnail already cached, file contents no longer needed
+            Indexer::release( fileName );
+            this->remember( hash, fileName );
+            this->queued.remove( fileName );
+
+            // done
+            this->deliver( fileName, entry );
+            return;
+        }
+    }
+
+    // entry of an old cache - convert instead of regenerating
+    if ( legacy && this->legacyIndex.contains( qMakePair( legacy, hash.second ))) {
+        DataEntry entry;
+
+        if ( this->readLegacy( this->legacyIndex.take( qMakePair( legacy, hash.second )), entry ) && this->write( hash, entry )) {
+            this->migratedCount++;
+            Indexer::release( fileName );
+            this->remember( hash, fileName );
+            this->queued.remove( fileName );
+            this->deliver( fileName, entry );
+
+            // all converted
+            if ( this->legacyIndex.isEmpty())
+                this->dropLegacy();
+            return;
+        }
+    }
+
+    // uncached (or damaged)
+    Work job( hash, fileName, DataEntry(), key, work.generation );
+
+    // contents read while hashing, decoded without reading the file again
+    job.source = work.source;
+    this->workPool.schedule( job, this->queued.value( fileName, WorkSystem::Unranked ));
+    //qDebug() << "Cache::indexingDone: uncached" << fileName;
+}
+
+/**
+ * @brief Cache::workDone
+ * @param fileName
+ */
+void Cache::workDone( const Work &work ) {
+    // cache to disk
+    if ( this->write( work.hash.first, work.hash.second, work.data.mimeType, work.data.imageList ))
+        this->remember( work.hash, work.fileName );
+    else if ( this->isValid())
+        this->reject( work.key, work.hash, work.data );
+
+    // a complete result is kept, but not delivered to a directory we already left
+    if ( work.generation != this->generation.load())
+        return;
+
+    // done
+    this->queued.remove( work.fileName );
+    this->deliver( work.fileName, work.data );
+}
+
+/**
+ * @brief Cache::deliver queues a result for the next batch
+ * @param fileName
+ * @param entry
+ */
+void Cache::deliver( const QString &fileName, const DataEntry &entry ) {
+    this->resultFiles << fileName;
+    this->resultEntries << entry;
+
+    if ( !this->resultTimer.isActive())
+        this->resultTimer.start();
+}
+
+/**
+ * @brief Cache::flushResults delivers all queued results in a single signal
+ */
+void Cache::flushResults() {
+    this->resultTimer.stop();
+    if ( this->resultFiles.isEmpty())
+        return;
+
+    emit this->finished( this->resultFiles, this->resultEntries );
+
+    // viewport complete
+    if ( !this->viewportPending.isEmpty()) {
+        foreach ( const QString &fileName, this->resultFiles )
+            this->viewportPending.remove( fileName );
+
+        if ( this->viewportPending.isEmpty()) {
+            const quint64 elapsed = static_cast<quint64>( this->viewportTimer.nsecsElapsed());
+
+            this->viewportCount++;
+            this->viewportTime += elapsed;
+            this->viewportWorst = qMax( this->viewportWorst, elapsed );
+        }
+    }
+
+    this->resultFiles.clear();
+    this->resultEntries.clear();
 }
@@ -22,10 +22,19 @@
 // includes
 //
 #include <QDataStream>
-#include <QPixmap>
+#include <QImage>
 #include <QDir>
 #include <QHash>
-#include "filestream.h"
+#include <QSet>
+#include <QCache>
+#include <QFutureWatcher>
+#include <QLockFile>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QSharedPointer>
+#include "storage.h"
+#include "codec.h"
+#include "workqueue.h"
 
 //
 // classes
@@ -38,54 +47,193 @@ struct Work;
  * @brief The CacheSystem namespace
  */
 namespace CacheSystem {
-    static const quint8 Version = 2;
+    static const quint8 Version = 9;
     static const QString IndexFilename( "files.index" );
+    static const QString TailFilename( "files.tail" );
     static const QString DataFilename( "files.data" );
+    static const QString PathsFilename( "files.paths" );
+    static const QString DirectoriesFilename( "files.dirs" );
+    static const QString BundlesFilename( "files.bundles" );
+    static const QString NegativesFilename( "files.negative" );
     static const qint64 MaxFileSize = 10485760;
+    static const QString CompactionMarker( "files.compact" );
+    static const QString LockFilename( "files.lock" ); // single writer
+    static const QString MaintenanceLockFilename( "files.maintenance" ); // single merge/compaction
+    static const int LockTimeout = 2000; // ms
+    static const int RefreshInterval = 1000; // ms
+    static const int ResultInterval = 16; // ms, results are delivered about once per frame
+    static const quint32 PackMagic = 0x464d504b; // "FMPK"
+    static const quint8 LegacyVersion = 2;
+    static const QString LegacySuffix( ".v2" );
+    static const int IndexHeaderSize = 14; // version + HashPolicy
+    static const int IndexRecordSize = 32;
+    static const int TailRecordSize = IndexRecordSize + 4; // + crc32
+    static const int PathRecordSize = 40 + 4; // StatKey, hash + crc32
+    static const int DirectoryRecordSize = 20 + 4; // hash, directory + crc32
+    static const int BundleRecordSize = 20 + 4; // directory, offset, length + crc32
+    static const int NegativeRecordSize = 33 + 4; // StatKey, reason + crc32
+    static const int MaxNegativeEntries = 65536;
+    static const int MaxTailEntries = 4096;
+    static const int ReadBufferSize = 262144;
+    static const int ReadAheadFiles = 4;
+    static const int ReadGap = 65536; // nearby frames are read in one go
+    static const int MaxReadSpan = 4194304;
+    static const int BatchEntries = 64;
+    static const int BatchBytes = 4194304;
+    static const qint64 SampleThreshold = MaxFileSize;
+    static const quint32 SampleChunkSize = 65536;
+    static const quint8 SampleChunks = 3; // head, middle, tail
+    static const int DefaultSizeBudget = 512; // MB
+    static const int CompactionTarget = 75; // % of budget kept after compaction
+    static const quint32 AccessGranularity = 3600; // seconds
+    static const int DefaultHotTierSize = 64; // MB of decoded levels
+    static const int MaxBufferedBytes = 67108864; // file contents handed from hashing to decoding
+    static const int SniffSize = 16384; // read for mimetype detection
+    static const int DefaultThreads = 0; // per pool, 0 - one per core
+    static const int NumPixmapLevels = 4;
+    static const int PixmapLevels[NumPixmapLevels] = { 64, 48, 32, 16 };
+    static const int DefaultCodec = Codec::Qoi;
+    static const int DefaultQuality = 85; // jpeg only
+
+    // why a file has no cache entry
+    enum Rejections {
+        EmptyFile = 0,
+        UnreadableFile,
+        UnknownType
+    };
 }
 
 /**
  * @brief Hash
  */
-typedef QPair<quint32, qint64> Hash;
+typedef QPair<quint64, qint64> Hash;
 Q_DECLARE_METATYPE( Hash )
 
+/**
+ * @brief LegacyIndex (version 2 checksum, size) -> offset in the old data file
+ */
+typedef QHash<QPair<quint32, qint64>, qint64> LegacyIndex;
+
+/**
+ * @brief DirectoryMap entry -> directory it was last seen in
+ */
+typedef QHash<Hash, quint32> DirectoryMap;
+
+/**
+ * @brief BundleMap directory -> contiguous range (offset, length) in the data file
+ */
+typedef QHash<quint32, QPair<qint64, qint64> > BundleMap;
+
 /**
  * @brief The IndexEntry struct
+ *
+ * serialized as a fixed-width (IndexRecordSize) big-endian record
  */
 struct IndexEntry {
-    IndexEntry( quint32 h = 0, qint64 s = 0, qint64 o = 0 ) : hash( h ), size( s ), offset( o ) {}
-    quint32 hash;
+    IndexEntry( quint64 h = 0, qint64 s = 0, qint64 o = 0, quint32 l = 0, quint32 a = 0 ) : hash( h ), size( s ), offset( o ), length( l ), accessed( a ) {}
+    quint64 hash;
     qint64 size;
     qint64 offset;
+    quint32 length;
+    quint32 accessed;
+};
+
+// read/write operators
+inline static QDataStream &operator<<( QDataStream &out, const IndexEntry &e ) { out << e.hash << e.size << e.offset << e.length << e.accessed; return out; }
+inline static QDataStream &operator>>( QDataStream &in, IndexEntry &e ) { in >> e.hash >> e.size >> e.offset >> e.length >> e.accessed; return in; }
+
+/**
+ * @brief The HashPolicy struct
+ *
+ * files larger than the threshold are identified by evenly spaced chunks
+ * (head, ..., tail) plus size and mtime; stored in the index header so
+ * that hashes stay consistent with the index they are looked up in
+ */
+struct HashPolicy {
+    HashPolicy( qint64 t = CacheSystem::SampleThreshold, quint32 s = CacheSystem::SampleChunkSize, quint8 c = CacheSystem::SampleChunks ) : threshold( t ), chunkSize( s ), chunks( c ) {}
+    bool operator==( const HashPolicy &other ) const { return this->threshold == other.threshold && this->chunkSize == other.chunkSize && this->chunks == other.chunks; }
+    bool sampled( qint64 size ) const { return this->threshold > 0 && size > this->threshold && this->chunks > 0 && size > static_cast<qint64>( this->chunkSize ) * this->chunks; }
+    qint64 sampleOffset( qint64 size, int chunk ) const { return this->chunks > 1 ? ( size - this->chunkSize ) / ( this->chunks - 1 ) * chunk : 0; }
+    qint64 threshold;
+    quint32 chunkSize;
+    quint8 chunks;
 };
 
 // read/write operators
-inline static QDataStream &operator<<( QDataStream &out, const IndexEntry &e ) { out << e.hash << e.size << e.offset; return out; }
-inline static QDataStream &operator>>( QDataStream &in, IndexEntry &e ) { in >> e.hash >> e.size >> e.offset; return in; }
+inline static QDataStream &operator<<( QDataStream &out, const HashPolicy &p ) { out << p.threshold << p.chunkSize << p.chunks; return out; }
+inline static QDataStream &operator>>( QDataStream &in, HashPolicy &p ) { in >> p.threshold >> p.chunkSize >> p.chunks; return in; }
 
 /**
  * @brief The DataEntry struct
+ *
+ * only the largest level is stored (encoded with the codec of the entry),
+ * smaller levels are derived from it when requested; levels are premultiplied
+ * QImages (RGB32 if opaque, so that they can be stored as jpeg), safe to
+ * produce on any thread (converted to pixmaps by the views)
  */
 struct DataEntry {
-    DataEntry( const QString &m = QString::null, QList<QPixmap> l = QList<QPixmap>()) : mimeType( m ), pixmapList( l ) {}
+    DataEntry( const QString &m = QString::null, QList<QImage> l = QList<QImage>()) : mimeType( m ), imageList( l ), levels( 0 ), codec( Codec::Png ), quality( -1 ) {}
+    int count() const { return this->imageList.isEmpty() ? ( this->encoded.isEmpty() ? 0 : this->levels ) : this->imageList.count(); }
+    QImage image( int level ) const;
+    bool decode();
+    QByteArray encode( Codec::Codecs &codec ) const;
     QString mimeType;
-    QList<QPixmap> pixmapList;
+    QList<QImage> imageList;
+    QByteArray encoded;
+    quint8 levels;
+    quint8 codec;
+    int quality; // lossy codecs only
 };
 Q_DECLARE_METATYPE( DataEntry )
 
 // read/write operators
-inline static QDataStream &operator<<( QDataStream &out, const DataEntry &e ) { out << e.mimeType << e.pixmapList; return out; }
-inline static QDataStream &operator>>( QDataStream &in, DataEntry &e ) { in >> e.mimeType >> e.pixmapList; return in; }
+inline static QDataStream &operator<<( QDataStream &out, const DataEntry &e ) {
+    Codec::Codecs codec = static_cast<Codec::Codecs>( e.codec );
+    const QByteArray bytes( e.encode( codec ));
+
+    out << e.mimeType << static_cast<quint8>( bytes.isEmpty() ? 0 : e.count()) << static_cast<quint8>( codec ) << bytes;
+    return out;
+}
+inline static QDataStream &operator>>( QDataStream &in, DataEntry &e ) {
+    in >> e.mimeType >> e.levels >> e.codec >> e.encoded;
+    return in;
+}
+
+/**
+ * @brief The SourceBuffer class
+ *
+ * contents of a file read once by the hashing stage and handed to the worker,
+ * so that sniffing and decoding need not read the file again; buffers in
+ * flight are limited to MaxBufferedBytes (past that the worker reads the file
+ * on its own); every read of a source file is counted
+ */
+class SourceBuffer {
+public:
+    ~SourceBuffer() { SourceBuffer::buffered.fetchAndAddRelaxed( -this->reserved ); }
+    static QSharedPointer<SourceBuffer> reserve( qint64 size );
+    static void count( qint64 bytes ) { SourceBuffer::read.fetchAndAddRelaxed( bytes ); }
+    static qint64 bytesRead() { return SourceBuffer::read.load(); }
+    QByteArray bytes;
+
+private:
+    Q_DISABLE_COPY( SourceBuffer )
+    explicit SourceBuffer( int size ) : reserved( size ) {}
+    int reserved;
+    static QAtomicInt buffered;
+    static QAtomicInteger<qint64> read;
+};
 
 /**
  * @brief The Work struct
  */
 struct Work {
-    Work( const Hash &h = Hash(), const QString &f = QString::null, const DataEntry &d = DataEntry()) : hash( h ), fileName( f ), data( d ) {}
+    Work( const Hash &h = Hash(), const QString &f = QString::null, const DataEntry &d = DataEntry(), const StatKey &k = StatKey(), int g = 0 ) : hash( h ), fileName( f ), data( d ), key( k ), generation( g ) {}
     Hash hash;
     QString fileName;
     DataEntry data;
+    StatKey key; // set if the file was unchanged while hashed
+    int generation; // navigation the job was queued in
+    QSharedPointer<SourceBuffer> source; // contents read while hashing (if any)
 };
 Q_DECLARE_METATYPE( Work )
 
@@ -96,42 +244,172 @@ class Cache : public QObject {
     Q_OBJECT
     Q_PROPERTY( QString path READ path )
     Q_PROPERTY( bool valid READ isValid )
+    Q_PROPERTY( ReadModes readMode READ readMode WRITE setReadMode )
+    Q_PROPERTY( qint64 sizeBudget READ sizeBudget WRITE setSizeBudget )
+    Q_PROPERTY( int hotTierSize READ hotTierSize WRITE setHotTierSize )
+    friend class Benchmarks;
 
 public:
+    enum ReadModes {
+        StreamRead = 0,
+        MappedRead
+    };
+    Q_ENUMS( ReadModes )
+
     Cache( const QString &path );
     ~Cache() { this->shutdown(); }
-    static quint32 checksum( const char *data, size_t len );
+    static quint64 checksum( const char *data, size_t len ) { return Checksum::hash64( data, len ); }
+    HashPolicy hashPolicy() const { return this->m_hashPolicy; }
+    ReadModes readMode() const { return this->m_readMode; }
+    qint64 sizeBudget() const { return this->m_sizeBudget; }
+    int hotTierSize() const { return this->hot.maxCost(); }
+    int exportPack( const QString &path, const QString &fileName );
+    int importPack( const QString &fileName );
 
 public slots:
     void process( const QString &fileName );
     void process( const QStringList &fileList );
     void stop();
+    void flush();
+    void setReadMode( ReadModes mode );
+    void setSizeBudget( qint64 budget ) { this->m_sizeBudget = budget; }
+    void setHotTierSize( int bytes ) { this->hot.setMaxCost( bytes ); }
 
 signals:
-    void finished( const QString &fileName, const DataEntry &entry );
+    void finished( const QStringList &fileList, const QList<DataEntry> &entryList );
 
 private slots:
     void setValid( bool valid ) { this->m_valid = valid; }
     void shutdown();
     void workDone( const Work &work );
-    void indexingDone( const QString &fileName, const Hash &hash );
+    void indexingDone( const Work &work, quint32 legacy );
+    void mergeDone();
+    void compactionDone();
+    void legacyLoaded();
+    void flushResults();
 
 private:
     Q_DISABLE_COPY( Cache )
     QString path() const { return this->m_path; }
     bool isValid() const { return this->m_valid; }
-    bool write( quint32 hash, qint64 size, const QString &mimeType, QList<QPixmap> pixmapList = QList<QPixmap>());
-    DataEntry cachedData( quint32 hash, qint64 size );
+    bool write( quint64 hash, qint64 size, const QString &mimeType, QList<QImage> imageList = QList<QImage>()) { return this->write( Hash( hash, size ), DataEntry( mimeType, imageList )); }
+    bool write( const Hash &hash, const DataEntry &dataEntry );
+    qint64 dataEnd() const { return this->committed + this->pendingData.size(); }
+    DataEntry cachedData( quint64 hash, qint64 size ) { return this->cachedData( QList<Hash>() << Hash( hash, size )).first(); }
     DataEntry cachedData( const Hash &hash ) { return this->cachedData( hash.first, hash.second ); }
-    bool contains( const Hash &hash ) const { return this->contains( hash.first, hash.second ); }
-    bool contains( quint32 hash, qint64 size ) const { return this->hash.contains( Hash( hash, size )); }
+    QList<DataEntry> cachedData( const QList<Hash> &hashList );
+    bool admit( const IndexEntry &indexEntry, DataEntry &entry, bool ok );
+    bool view( const IndexEntry &indexEntry, DataEntry &entry );
+    bool contains( const Hash &hash ) { IndexEntry entry; return this->find( hash, entry ); }
+    bool contains( quint64 hash, qint64 size ) { return this->contains( Hash( hash, size )); }
+    bool find( const Hash &hash, IndexEntry &entry );
+    bool search( const Hash &hash, IndexEntry &entry ) const;
     bool read();
+    bool reset();
+    bool migrate( quint8 version );
+    void openLegacy();
+    bool readLegacy( qint64 offset, DataEntry &entry );
+    void dropLegacy();
+    void readPaths();
+    void readNegatives();
+    void reject( const StatKey &key, const Hash &hash, const DataEntry &entry );
+    DataEntry rejected( const QString &fileName, const StatKey &key ) const;
+    void readDirectories();
+    void writeDirectories();
+    void readBundles();
+    void remember( const Hash &hash, const QString &fileName );
+    void prefetch( const QString &fileName );
+    bool lock( int timeout = CacheSystem::LockTimeout ) { return this->writerLock.lock( timeout ); }
+    void unlock() { this->writerLock.unlock(); }
+    void identify();
+    void refresh();
+    void poll() { if ( this->refreshTimer.hasExpired( CacheSystem::RefreshInterval )) { this->refreshTimer.restart(); this->refresh(); } }
+    bool reopen();
+    void rebase( qint64 size );
+    static quint32 directoryId( const QString &path );
+    bool resolve( const QString &fileName, StatKey &key, Hash &hash );
+    void reprioritize( const QHash<QString, int> &ranks );
+    void deliver( const QString &fileName, const DataEntry &entry );
+    void commitAccess();
+    void mergeTail();
+    void compact();
+    void finishMaintenance();
+    static bool parse( const QByteArray &frame, DataEntry &entry );
+    static QList<IndexEntry> readTail( const QString &tailFilename, qint64 tailSize );
+    static bool mergeIndex( const QString &indexFilename, const QString &tailFilename, qint64 tailSize, const QString &outFilename );
+    static bool compactData( const QString &path, qint64 tailSize, qint64 budget, const DirectoryMap &directories );
+    static LegacyIndex readLegacyIndex( const QString &indexFilename );
+    static void commitCompaction( const QString &path );
     FileStream index;
+    FileStream tail;
     FileStream data;
+    FileStream paths;
+    FileStream dirs;
+    FileStream negatives;
     QString m_path;
     QHash<Hash, IndexEntry> hash;
+    QHash<StatKey, quint64> pathIndex;
+    QHash<StatKey, quint8> negativeIndex;
+    QHash<QString, StatKey> pendingKeys;
+    QHash<QString, int> queued; // being hashed or decoded -> priority
+    QStringList resultFiles;
+    QList<DataEntry> resultEntries;
+    QTimer resultTimer;
+    QSet<Hash> damaged;
+    QCache<Hash, DataEntry> hot;
+    quint64 hotHits;
+    quint64 hotMisses;
+    quint64 hotEvictions;
+    HashPolicy m_hashPolicy;
+    quint8 m_codec;
+    int m_quality;
+    QByteArray pendingData;
+    QByteArray pendingTail;
+    QByteArray pendingDirs;
+    QByteArray pendingPaths;
+    QByteArray pendingNegatives;
+    QList<IndexEntry> pendingEntries;
+    DirectoryMap directories;
+    BundleMap bundles;
+    QString lastDirectory;
+    bool bundled;
+    int pendingCount;
+    quint64 batchCount;
+    quint64 batchedCount;
+    int tailCount;
+    qint64 mergeSnapshot;
+    QFutureWatcher<bool> mergeWatcher;
+    qint64 m_sizeBudget;
+    qint64 compactionSnapshot;
+    qint64 compactionDataSnapshot;
+    QFutureWatcher<bool> compactionWatcher;
+    LegacyIndex legacyIndex;
+    QFutureWatcher<LegacyIndex> legacyWatcher;
+    QFile legacyData;
+    quint64 migratedCount;
     bool m_valid;
+    ReadModes m_readMode;
+    quint64 readCount;
+    quint64 readTime;
+    QSet<QString> viewportPending; // files of the last viewport not delivered yet
+    QElapsedTimer viewportTimer;
+    quint64 viewportCount;
+    quint64 viewportTime;
+    quint64 viewportWorst;
+    quint64 viewportDropped;
     QDir cacheDir;
-    Worker *worker;
-    Indexer *indexer;
+    WorkPool<Work> indexPool;
+    WorkPool<Work> workPool;
+    QAtomicInt generation; // bumped on navigation, cancels queued and running jobs
+    QList<Indexer *> indexers;
+    QList<Worker *> workers;
+    StorageLock writerLock;
+    QLockFile maintenanceLock;
+    qint64 committed;
+    qint64 tailPos;
+    StatKey indexKey;
+    StatKey dataKey;
+    QElapsedTimer refreshTimer;
 };
+
+Q_DECLARE_METATYPE( Cache::ReadModes )
@@ -0,0 +1,663 @@
+/*
+ * Copyright (C) 2017 Zvaigznu Planetarijs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+//
+// includes
+//
+#include <QtEndian>
+#include "checksum.h"
+
+//
+// SIMD support
+//
+#if defined( Q_PROCESSOR_X86 ) && Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+#define CHECKSUM_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef Q_CC_MSVC
+#include <intrin.h>
+#endif
+#elif ( defined( __ARM_NEON ) || defined( __ARM_NEON__ )) && Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+#define CHECKSUM_NEON
+#include <arm_neon.h>
+#endif
+
+// gcc/clang compile individual functions for extended instruction sets
+#if defined( CHECKSUM_X86 ) && defined( Q_CC_GNU )
+#define CHECKSUM_TARGET( x ) __attribute__(( target( x )))
+#else
+#define CHECKSUM_TARGET( x )
+#endif
+
+/*
+  The Checksum
+
+  OVERVIEW:
+    input is processed in 64 byte stripes, each stripe updates eight 64-bit
+    accumulators with a 32x32->64 multiply of the keyed input, while the
+    raw input is added to the neighbouring lane; every 16 stripes the
+    accumulators are scrambled; the remaining (<64) bytes and the length
+    are mixed in at the end
+
+    all kernels produce identical results, the scalar one is the reference
+*/
+
+//
+// constants
+//
+static const size_t StripeSize = 64;
+static const quint32 StripesPerBlock = 16;
+static const quint64 Prime1 = Q_UINT64_C( 0x9e3779b185ebca87 );
+static const quint64 Prime2 = Q_UINT64_C( 0xc2b2ae3d27d4eb4f );
+static const quint64 Prime3 = Q_UINT64_C( 0x165667b19e3779f9 );
+static const quint64 Prime4 = Q_UINT64_C( 0x85ebca77c2b2ae63 );
+static const quint64 Prime5 = Q_UINT64_C( 0x27d4eb2f165667c5 );
+static const quint32 Prime32 = 0x9e3779b1;
+static const quint64 Key[8] = {
+    Q_UINT64_C( 0x6e789e6aa1b965f4 ), Q_UINT64_C( 0x06c45d188009454f ),
+    Q_UINT64_C( 0xf88bb8a8724c81ec ), Q_UINT64_C( 0x1b39896a51a8749b ),
+    Q_UINT64_C( 0x53cb9f0c747ea2ea ), Q_UINT64_C( 0x2c829abe1f4532e1 ),
+    Q_UINT64_C( 0xc584133ac916ab3c ), Q_UINT64_C( 0x3ee5789041c98ac3 )
+};
+static const quint64 ScrambleKey[8] = {
+    Q_UINT64_C( 0xf3b8488c368cb0a6 ), Q_UINT64_C( 0x657eecdd3cb13d09 ),
+    Q_UINT64_C( 0xc2d326e0055bdef6 ), Q_UINT64_C( 0x8621a03fe0bbdb7b ),
+    Q_UINT64_C( 0x8e1f7555983aa92f ), Q_UINT64_C( 0xb54e0f1600cc4d19 ),
+    Q_UINT64_C( 0x84bb3f97971d80ab ), Q_UINT64_C( 0x7d29825c75521255 )
+};
+static const quint64 InitialAcc[8] = { Prime3, Prime1, Prime2, Prime3, Prime4, Prime2, Prime5, Prime1 };
+
+/**
+ * @brief rotl
+ * @param value
+ * @param bits
+ * @return
+ */
+static inline quint64 rotl( quint64 value, int bits ) {
+    return ( value << bits ) | ( value >> ( 64 - bits ));
+}
+
+/**
+ * @brief mix
+ * @param value
+ * @return
+ */
+static inline quint64 mix( quint64 value ) {
+    return rotl( value * Prime2, 31 ) * Prime1;
+}
+
+/**
+ * @brief accumulateScalar
+ * @param acc
+ * @param data
+ * @param stripes
+ * @param stripe
+ */
+static void accumulateScalar( quint64 *acc, const uchar *data, size_t stripes, quint32 &stripe ) {
+    size_t s;
+    int y;
+
+    for ( s = 0; s < stripes; s++, data += StripeSize ) {
+        for ( y = 0; y < 8; y++ ) {
+            const quint64 value = qFromLittleEndian<quint64>( data + y * 8 );
+            const quint64 keyed = value ^ Key[y];
+
+            acc[y ^ 1] += value;
+            acc[y] += ( keyed & 0xffffffff ) * ( keyed >> 32 );
+        }
+
+        // scramble
+        if ( ++stripe == StripesPerBlock ) {
+            for ( y = 0; y < 8; y++ ) {
+                acc[y] ^= acc[y] >> 47;
+                acc[y] ^= ScrambleKey[y];
+                acc[y] *= Prime32;
+            }
+            stripe = 0;
+        }
+    }
+}
+
+#ifdef CHECKSUM_X86
+/**
+ * @brief accumulateSSE2
+ * @param acc
+ * @param data
+ * @param stripes
+ * @param stripe
+ */
+CHECKSUM_TARGET( "sse2" )
+static void accumulateSSE2( quint64 *acc, const uchar *data, size_t stripes, quint32 &stripe ) {
+    const __m128i prime = _mm_set1_epi32( static_cast<int>( Prime32 ));
+    __m128i a[4], key[4], scramble[4];
+    size_t s;
+    int y;
+
+    for ( y = 0; y < 4; y++ ) {
+        a[y] = _mm_loadu_si128( reinterpret_cast<const __m128i *>( acc ) + y );
+        key[y] = _mm_loadu_si128( reinterpret_cast<const __m128i *>( Key ) + y );
+        scramble[y] = _mm_loadu_si128( reinterpret_cast<const __m128i *>( ScrambleKey ) + y );
+    }
+
+    for ( s = 0; s < stripes; s++, data += StripeSize ) {
+        for ( y = 0; y < 4; y++ ) {
+            const __m128i value = _mm_loadu_si128( reinterpret_cast<const __m128i *>( data ) + y );
+            const __m128i keyed = _mm_xor_si128( value, key[y] );
+
+            // lo32 * hi32 of each lane, raw input goes to the swapped lane
+            a[y] = _mm_add_epi64( a[y], _mm_mul_epu32( keyed, _mm_shuffle_epi32( keyed, _MM_SHUFFLE( 0, 3, 0, 1 ))));
+            a[y] = _mm_add_epi64( a[y], _mm_shuffle_epi32( value, _MM_SHUFFLE( 1, 0, 3, 2 )));
+        }
+
+        // scramble (64-bit multiply by a 32-bit constant in two halves)
+        if ( ++stripe == StripesPerBlock ) {
+            for ( y = 0; y < 4; y++ ) {
+                __m128i x = _mm_xor_si128( a[y], _mm_srli_epi64( a[y], 47 ));
+                x = _mm_xor_si128( x, scramble[y] );
+                a[y] = _mm_add_epi64( _mm_mul_epu32( x, prime ), _mm_slli_epi64( _mm_mul_epu32( _mm_srli_epi64( x, 32 ), prime ), 32 ));
+            }
+            stripe = 0;
+        }
+    }
+
+    for ( y = 0; y < 4; y++ )
+        _mm_storeu_si128( reinterpret_cast<__m128i *>( acc ) + y, a[y] );
+}
+
+/**
+ * @brief accumulateAVX2
+ * @param acc
+ * @param data
+ * @param stripes
+ * @param stripe
+ */
+CHECKSUM_TARGET( "avx2" )
+static void accumulateAVX2( quint64 *acc, const uchar *data, size_t stripes, quint32 &stripe ) {
+    const __m256i prime = _mm256_set1_epi32( static_cast<int>( Prime32 ));
+    __m256i a[2], key[2], scramble[2];
+    size_t s;
+    int y;
+
+    for ( y = 0; y < 2; y++ ) {
+        a[y] = _mm256_loadu_si256( reinterpret_cast<const __m256i *>( acc ) + y );
+        key[y] = _mm256_loadu_si256( reinterpret_cast<const __m256i *>( Key ) + y );
+        scramble[y] = _mm256_loadu_si256( reinterpret_cast<const __m256i *>( ScrambleKey ) + y );
+    }
+
+    for ( s = 0; s < stripes; s++, data += StripeSize ) {
+        for ( y = 0; y < 2; y++ ) {
+            const __m256i value = _mm256_loadu_si256( reinterpret_cast<const __m256i *>( data ) + y );
+            const __m256i keyed = _mm256_xor_si256( value, key[y] );
+
+            // same as SSE2, shuffles operate within 128-bit halves
+            a[y] = _mm256_add_epi64( a[y], _mm256_mul_epu32( keyed, _mm256_shuffle_epi32( keyed, _MM_SHUFFLE( 0, 3, 0, 1 ))));
+            a[y] = _mm256_add_epi64( a[y], _mm256_shuffle_epi32( value, _MM_SHUFFLE( 1, 0, 3, 2 )));
+        }
+
+        if ( ++stripe == StripesPerBlock ) {
+            for ( y = 0; y < 2; y++ ) {
+                __m256i x = _mm256_xor_si256( a[y], _mm256_srli_epi64( a[y], 47 ));
+                x = _mm256_xor_si256( x, scramble[y] );
+                a[y] = _mm256_add_epi64( _mm256_mul_epu32( x, prime ), _mm256_slli_epi64( _mm256_mul_epu32( _mm256_srli_epi64( x, 32 ), prime ), 32 ));
+            }
+            stripe = 0;
+        }
+    }
+
+    for ( y = 0; y < 2; y++ )
+        _mm256_storeu_si256( reinterpret_cast<__m256i *>( acc ) + y, a[y] );
+}
+#endif
+
+#ifdef CHECKSUM_NEON
+/**
+ * @brief accumulateNEON
+ * @param acc
+ * @param data
+ * @param stripes
+ * @param stripe
+ */
+static void accumulateNEON( quint64 *acc, const uchar *data, size_t stripes, quint32 &stripe ) {
+    const uint32x2_t prime = vdup_n_u32( Prime32 );
+    uint64x2_t a[4], key[4], scramble[4];
+    size_t s;
+    int y;
+
+    for ( y = 0; y < 4; y++ ) {
+        a[y] = vld1q_u64( acc + y * 2 );
+        key[y] = vld1q_u64( Key + y * 2 );
+        scramble[y] = vld1q_u64( ScrambleKey + y * 2 );
+    }
+
+    for ( s = 0; s < stripes; s++, data += StripeSize ) {
+        for ( y = 0; y < 4; y++ ) {
+            const uint64x2_t value = vreinterpretq_u64_u8( vld1q_u8( data + y * 16 ));
+            const uint64x2_t keyed = veorq_u64( value, key[y] );
+
+            a[y] = vmlal_u32( a[y], vmovn_u64( keyed ), vshrn_n_u64( keyed, 32 ));
+            a[y] = vaddq_u64( a[y], vextq_u64( value, value, 1 ));
+        }
+
+        if ( ++stripe == StripesPerBlock ) {
+            for ( y = 0; y < 4; y++ ) {
+                uint64x2_t x = veorq_u64( a[y], vshrq_n_u64( a[y], 47 ));
+                x = veorq_u64( x, scramble[y] );
+                a[y] = vmlal_u32( vshlq_n_u64( vmull_u32( vshrn_n_u64( x, 32 ), prime ), 32 ), vmovn_u64( x ), prime );
+            }
+            stripe = 0;
+        }
+    }
+
+    for ( y = 0; y < 4; y++ )
+        vst1q_u64( acc + y * 2, a[y] );
+}
+#endif
+
+/**
+ * @brief finalize
+ * @param acc
+ * @param data
+ * @param remaining
+ * @param length
+ * @return
+ */
+static quint64 finalize( const quint64 *acc, const uchar *data, size_t remaining, quint64 length ) {
+    quint64 h = length * Prime1 + Prime5;
+    int y;
+
+    // merge accumulators
+    for ( y = 0; y < 8; y++ )
+        h = ( h ^ mix( acc[y] )) * Prime1 + Prime4;
+
+    // mix in the remaining bytes
+    for ( ; remaining >= 8; remaining -= 8, data += 8 ) {
+        h ^= mix( qFromLittleEndian<quint64>( data ));
+        h = rotl( h, 27 ) * Prime1 + Prime4;
+    }
+
+    if ( remaining >= 4 ) {
+        h ^= static_cast<quint64>( qFromLittleEndian<quint32>( data )) * Prime1;
+        h = rotl( h, 23 ) * Prime2 + Prime3;
+        remaining -= 4;
+        data += 4;
+    }
+
+    for ( ; remaining > 0; remaining--, data++ ) {
+        h ^= *data * Prime5;
+        h = rotl( h, 11 ) * Prime1;
+    }
+
+    // avalanche
+    h ^= h >> 33;
+    h *= Prime2;
+    h ^= h >> 29;
+    h *= Prime3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/**
+ * @brief Checksum::isSupported
+ * @param kernel
+ * @return
+ */
+bool Checksum::isSupported( Kernels kernel ) {
+    switch ( kernel ) {
+    case Scalar:
+        return true;
+
+#ifdef CHECKSUM_X86
+    case SSE2:
+#ifdef Q_CC_MSVC
+    {
+        int info[4];
+        __cpuid( info, 1 );
+        return ( info[3] & ( 1 << 26 )) != 0;
+    }
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports( "sse2" );
+#endif
+
+    case AVX2:
+#ifdef Q_CC_MSVC
+    {
+        int info[4];
+
+        // AVX2 flag and OS support for saving ymm registers
+        __cpuid( info, 0 );
+        if ( info[0] < 7 )
+            return false;
+
+        __cpuid( info, 1 );
+        if (( info[2] & ( 1 << 27 )) == 0 || ( info[2] & ( 1 << 28 )) == 0 || ( _xgetbv( 0 ) & 6 ) != 6 )
+            return false;
+
+        __cpuidex( info, 7, 0 );
+        return ( info[1] & ( 1 << 5 )) != 0;
+    }
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports( "avx2" );
+#endif
+#endif
+
+#ifdef CHECKSUM_NEON
+    case NEON:
+        return true;
+#endif
+
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Checksum::kernel
+ * @return
+ */
+Checksum::Kernels Checksum::kernel() {
+    static const Kernels best = Checksum::isSupported( AVX2 ) ? AVX2 : Checksum::isSupported( NEON ) ? NEON : Checksum::isSupported( SSE2 ) ? SSE2 : Scalar;
+    return best;
+}
+
+/**
+ * @brief Checksum::kernelName
+ * @param kernel
+ * @return
+ */
+const char *Checksum::kernelName( Kernels kernel ) {
+    switch ( kernel ) {
+    case SSE2:
+        return "SSE2";
+
+    case AVX2:
+        return "AVX2";
+
+    case NEON:
+        return "NEON";
+
+    case Scalar:
+    default:
+        return "scalar";
+    }
+}
+
+/**
+ * @brief Checksum::accumulator
+ * @param kernel
+ * @return
+ */
+Checksum::Accumulate Checksum::accumulator( Kernels kernel ) {
+    switch ( kernel ) {
+#ifdef CHECKSUM_X86
+    case SSE2:
+        return accumulateSSE2;
+
+    case AVX2:
+        return accumulateAVX2;
+#endif
+
+#ifdef CHECKSUM_NEON
+    case NEON:
+        return accumulateNEON;
+#endif
+
+    case Scalar:
+    default:
+        return accumulateScalar;
+    }
+}
+
+/**
+ * @brief Checksum::accumulator
+ * @return
+ */
+Checksum::Accumulate Checksum::accumulator() {
+    // detected once
+    static const Accumulate accumulate = Checksum::accumulator( Checksum::kernel());
+    return accumulate;
+}
+
+/**
+ * @brief Checksum::hash64
+ * @param data
+ * @param len
+ * @return
+ */
+quint64 Checksum::hash64( const char *data, size_t len ) {
+    return Checksum::compute( data, len, Checksum::accumulator());
+}
+
+/**
+ * @brief Checksum::hash64
+ * @param data
+ * @param len
+ * @param kernel
+ * @return
+ */
+quint64 Checksum::hash64( const char *data, size_t len, Kernels kernel ) {
+    return Checksum::compute( data, len, Checksum::accumulator( Checksum::isSupported( kernel ) ? kernel : Scalar ));
+}
+
+/**
+ * @brief Checksum::compute
+ * @param data
+ * @param len
+ * @param accumulate
+ * @return
+ */
+quint64 Checksum::compute( const char *data, size_t len, Accumulate accumulate ) {
+    const uchar *bytes = reinterpret_cast<const uchar *>( data );
+    const size_t stripes = len / StripeSize;
+    quint64 acc[8];
+    quint32 stripe = 0;
+    int y;
+
+    for ( y = 0; y < 8; y++ )
+        acc[y] = InitialAcc[y];
+
+    accumulate( acc, bytes, stripes, stripe );
+    return finalize( acc, bytes + stripes * StripeSize, len % StripeSize, len );
+}
+
+/**
+ * @brief Checksum::Stream::reset
+ */
+void Checksum::Stream::reset() {
+    int y;
+
+    for ( y = 0; y < 8; y++ )
+        this->acc[y] = InitialAcc[y];
+
+    this->buffered = 0;
+    this->length = 0;
+    this->stripe = 0;
+}
+
+/**
+ * @brief Checksum::Stream::update
+ * @param data
+ * @param len
+ */
+void Checksum::Stream::update( const char *data, size_t len ) {
+    const uchar *bytes = reinterpret_cast<const uchar *>( data );
+    const Accumulate accumulate = Checksum::accumulator();
+    size_t stripes, count;
+
+    this->length += len;
+
+    // complete a partially filled stripe first
+    if ( this->buffered ) {
+        count = qMin( StripeSize - this->buffered, len );
+        memcpy( this->buffer + this->buffered, bytes, count );
+        this->buffered += count;
+        bytes += count;
+        len -= count;
+
+        if ( this->buffered < StripeSize )
+            return;
+
+        accumulate( this->acc, this->buffer, 1, this->stripe );
+        this->buffered = 0;
+    }
+
+    // full stripes straight from input
+    stripes = len / StripeSize;
+    accumulate( this->acc, bytes, stripes, this->stripe );
+    bytes += stripes * StripeSize;
+    len -= stripes * StripeSize;
+
+    // keep the rest for later
+    memcpy( this->buffer, bytes, len );
+    this->buffered = len;
+}
+
+/**
+ * @brief Checksum::Stream::digest
+ * @return
+ */
+quint64 Checksum::Stream::digest() const {
+    return finalize( this->acc, this->buffer, this->buffered, this->length );
+}
+
+/**
+ * @brief The CrcTables struct (slice-by-8 tables for the reflected CRC-32/IEEE polynomial)
+ */
+struct CrcTables {
+    CrcTables() {
+        quint32 crc;
+        int y, k;
+
+        for ( y = 0; y < 256; y++ ) {
+            crc = static_cast<quint32>( y );
+            for ( k = 0; k < 8; k++ )
+                crc = ( crc >> 1 ) ^ ( 0xedb88320 & ( 0 - ( crc & 1 )));
+            this->t[0][y] = crc;
+        }
+
+        for ( y = 0; y < 256; y++ ) {
+            for ( k = 1; k < 8; k++ )
+                this->t[k][y] = ( this->t[k - 1][y] >> 8 ) ^ this->t[0][this->t[k - 1][y] & 0xff];
+        }
+    }
+    quint32 t[8][256];
+};
+
+/**
+ * @brief crcTables
+ * @return
+ */
+static const quint32 *crcTables() {
+    // built once, thread-safe
+    static const CrcTables tables;
+    return tables.t[0];
+}
+
+/**
+ * @brief Checksum::crc32
+ * @param data
+ * @param len
+ * @param crc previous value when checksumming in parts
+ * @return
+ */
+quint32 Checksum::crc32( const char *data, size_t len, quint32 crc ) {
+    const uchar *bytes = reinterpret_cast<const uchar *>( data );
+    const quint32 *t = crcTables();
+    quint32 low, high;
+
+    crc = ~crc;
+
+    // eight bytes at a time
+    while ( len >= 8 ) {
+        low = qFromLittleEndian<quint32>( bytes ) ^ crc;
+        high = qFromLittleEndian<quint32>( bytes + 4 );
+        crc = t[7 * 256 + ( low & 0xff )] ^ t[6 * 256 + (( low >> 8 ) & 0xff )] ^ t[5 * 256 + (( low >> 16 ) & 0xff )] ^ t[4 * 256 + ( low >> 24 )] ^
+              t[3 * 256 + ( high & 0xff )] ^ t[2 * 256 + (( high >> 8 ) & 0xff )] ^ t[1 * 256 + (( high >> 16 ) & 0xff )] ^ t[high >> 24];
+        bytes += 8;
+        len -= 8;
+    }
+
+    while ( len-- )
+        crc = ( crc >> 8 ) ^ t[( crc ^ *bytes++ ) & 0xff];
+
+    return ~crc;
+}
+
+/**
+ * @brief Checksum::Legacy::update
+ * @param data
+ * @param len
+ */
+void Checksum::Legacy::update( const char *data, size_t len ) {
+    const quint32 m = 0x5bd1e995;
+    quint32 w;
+
+    while ( len ) {
+        // whole words straight from input
+        if ( !this->buffered && len >= 4 ) {
+            memcpy( &w, data, 4 );
+            this->h += w;
+            this->h *= m;
+            this->h ^= ( this->h >> 16 );
+            data += 4;
+            len -= 4;
+            continue;
+        }
+
+        this->buffer[this->buffered++] = *data++;
+        len--;
+
+        // same word reads as the original (native byte order)
+        if ( this->buffered == 4 ) {
+            memcpy( &w, this->buffer, 4 );
+            this->h += w;
+            this->h *= m;
+            this->h ^= ( this->h >> 16 );
+            this->buffered = 0;
+        }
+    }
+}
+
+/**
+ * @brief Checksum::Legacy::digest
+ * @return
+ */
+quint32 Checksum::Legacy::digest() const {
+    const quint32 m = 0x5bd1e995, r = 24;
+    quint32 h = this->h;
+
+    switch ( this->buffered ) {
+    case 3:
+        h += this->buffer[2] << 16;
+        // fall through
+
+    case 2:
+        h += this->buffer[1] << 8;
+        // fall through
+
+    case 1:
+        h += this->buffer[0];
+        h *= m;
+        h ^= ( h >> r );
+        break;
+    }
+
+    return h;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2017 Zvaigznu Planetarijs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#pragma once
+
+//
+// includes
+//
+#include <QtGlobal>
+
+/**
+ * @brief The Checksum class
+ *
+ * 64-bit content hash used as the cache key, processes 64 byte stripes
+ * in eight 64-bit lanes (SSE2/AVX2/NEON variants, selected at runtime);
+ * also provides the crc32 that guards records on disk
+ */
+class Checksum {
+public:
+    enum Kernels {
+        Scalar = 0,
+        SSE2,
+        AVX2,
+        NEON
+    };
+
+    static quint64 hash64( const char *data, size_t len );
+    static quint64 hash64( const char *data, size_t len, Kernels kernel );
+    static Kernels kernel();
+    static bool isSupported( Kernels kernel );
+    static const char *kernelName( Kernels kernel );
+    static quint32 crc32( const char *data, size_t len, quint32 crc = 0 );
+
+    /**
+     * @brief The Stream class (incremental hashing, same result as hash64)
+     */
+    class Stream {
+    public:
+        Stream() { this->reset(); }
+        void reset();
+        void update( const char *data, size_t len );
+        quint64 digest() const;
+
+    private:
+        quint64 acc[8];
+        uchar buffer[64];
+        size_t buffered;
+        quint64 length;
+        quint32 stripe;
+    };
+
+    /**
+     * @brief The Legacy class (32-bit checksum of cache version 2, kept for migration)
+     */
+    class Legacy {
+    public:
+        Legacy() : h( 0 ), buffered( 0 ) {}
+        void update( const char *data, size_t len );
+        quint32 digest() const;
+
+    private:
+        quint32 h;
+        char buffer[4];
+        size_t buffered;
+    };
+
+private:
+    typedef void ( *Accumulate )( quint64 *acc, const uchar *data, size_t stripes, quint32 &stripe );
+    static Accumulate accumulator( Kernels kernel );
+    static Accumulate accumulator();
+    static quint64 compute( const char *data, size_t len, Accumulate accumulate );
+};
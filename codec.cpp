@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2017 Zvaigznu Planetarijs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+//
+// includes
+//
+#include <QBuffer>
+#include <QtEndian>
+#include <cstring>
+#include "codec.h"
+
+/*
+  QOI layout (see qoiformat.org):
+    header - "qoif", width, height (big-endian), channels, colorspace
+    chunks - INDEX (into 64 recently seen pixels), DIFF/LUMA (small deltas
+             to the previous pixel), RUN (of the previous pixel), RGB, RGBA
+    end    - seven zero bytes and a one
+
+  pixels are handled as non-premultiplied ARGB32, so no conversion is needed
+  for images Qt already holds in that format
+*/
+
+//
+// defines
+//
+namespace QoiSystem {
+    static const int HeaderSize = 14;
+    static const int PaddingSize = 8;
+    static const int MaxDimension = 4096; // thumbnails only
+    static const uchar OpIndex = 0x00;
+    static const uchar OpDiff = 0x40;
+    static const uchar OpLuma = 0x80;
+    static const uchar OpRun = 0xc0;
+    static const uchar OpRGB = 0xfe;
+    static const uchar OpRGBA = 0xff;
+    static const uchar Mask = 0xc0;
+    static const int MaxRun = 62;
+}
+
+/**
+ * @brief qoiHash
+ * @param pixel
+ * @return slot in the index of recently seen pixels
+ */
+static inline int qoiHash( QRgb pixel ) {
+    return ( qRed( pixel ) * 3 + qGreen( pixel ) * 5 + qBlue( pixel ) * 7 + qAlpha( pixel ) * 11 ) % 64;
+}
+
+/**
+ * @brief Codec::encode
+ * @param image
+ * @param codec requested codec (set to the one actually used)
+ * @param quality lossy codecs only
+ * @return
+ */
+QByteArray Codec::encode( const QImage &image, Codecs &codec, int quality ) {
+    QByteArray bytes;
+    QBuffer buffer( &bytes );
+
+    if ( image.isNull())
+        return bytes;
+
+    // jpeg has no alpha channel
+    if ( codec == Jpeg && image.hasAlphaChannel())
+        codec = Qoi;
+
+    if ( codec == Qoi )
+        return Codec::encodeQoi( image );
+
+    buffer.open( QIODevice::WriteOnly );
+    if ( codec == Jpeg )
+        image.save( &buffer, "JPG", quality );
+    else
+        image.save( &buffer, "PNG" );
+
+    return bytes;
+}
+
+/**
+ * @brief Codec::decode
+ * @param bytes
+ * @param codec
+ * @return
+ */
+QImage Codec::decode( const QByteArray &bytes, Codecs codec ) {
+    if ( bytes.isEmpty())
+        return QImage();
+
+    if ( codec == Qoi )
+        return Codec::decodeQoi( bytes );
+
+    return QImage::fromData( bytes, codec == Jpeg ? "JPG" : "PNG" );
+}
+
+/**
+ * @brief Codec::encodeQoi
+ * @param source
+ * @return
+ */
+QByteArray Codec::encodeQoi( const QImage &source ) {
+    const QImage image( source.format() == QImage::Format_ARGB32 ? source : source.convertToFormat( QImage::Format_ARGB32 ));
+    const int width = image.width(), height = image.height();
+    QRgb index[64], previous = qRgba( 0, 0, 0, 255 );
+    QByteArray bytes;
+    uchar *out;
+    int x, y, pos, run = 0;
+
+    if ( image.isNull() || width > QoiSystem::MaxDimension || height > QoiSystem::MaxDimension )
+        return QByteArray();
+
+    // worst case - every pixel as RGBA
+    bytes.resize( QoiSystem::HeaderSize + width * height * 5 + QoiSystem::PaddingSize );
+    out = reinterpret_cast<uchar *>( bytes.data());
+    memset( index, 0, sizeof( index ));
+
+    // header
+    memcpy( out, "qoif", 4 );
+    qToBigEndian<quint32>( static_cast<quint32>( width ), out + 4 );
+    qToBigEndian<quint32>( static_cast<quint32>( height ), out + 8 );
+    out[12] = 4;
+    out[13] = 0;
+    pos = QoiSystem::HeaderSize;
+
+    for ( y = 0; y < height; y++ ) {
+        const QRgb *line = reinterpret_cast<const QRgb *>( image.constScanLine( y ));
+
+        for ( x = 0; x < width; x++ ) {
+            const QRgb pixel = line[x];
+            int slot;
+
+            // repeated pixel
+            if ( pixel == previous ) {
+                if ( ++run == QoiSystem::MaxRun ) {
+                    out[pos++] = QoiSystem::OpRun | static_cast<uchar>( run - 1 );
+                    run = 0;
+                }
+                continue;
+            }
+
+            if ( run ) {
+                out[pos++] = QoiSystem::OpRun | static_cast<uchar>( run - 1 );
+                run = 0;
+            }
+
+            // recently seen pixel
+            slot = qoiHash( pixel );
+            if ( index[slot] == pixel ) {
+                out[pos++] = QoiSystem::OpIndex | static_cast<uchar>( slot );
+                previous = pixel;
+                continue;
+            }
+            index[slot] = pixel;
+
+            if ( qAlpha( pixel ) == qAlpha( previous )) {
+                // deltas wrap around, as in the decoder
+                const qint8 dr = static_cast<qint8>( qRed( pixel ) - qRed( previous ));
+                const qint8 dg = static_cast<qint8>( qGreen( pixel ) - qGreen( previous ));
+                const qint8 db = static_cast<qint8>( qBlue( pixel ) - qBlue( previous ));
+                const qint8 drg = static_cast<qint8>( dr - dg );
+                const qint8 dbg = static_cast<qint8>( db - dg );
+
+                if ( dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2 ) {
+                    out[pos++] = QoiSystem::OpDiff | static_cast<uchar>(( dr + 2 ) << 4 | ( dg + 2 ) << 2 | ( db + 2 ));
+                } else if ( drg > -9 && drg < 8 && dg > -33 && dg < 32 && dbg > -9 && dbg < 8 ) {
+                    out[pos++] = QoiSystem::OpLuma | static_cast<uchar>( dg + 32 );
+                    out[pos++] = static_cast<uchar>(( drg + 8 ) << 4 | ( dbg + 8 ));
+                } else {
+                    out[pos++] = QoiSystem::OpRGB;
+                    out[pos++] = static_cast<uchar>( qRed( pixel ));
+                    out[pos++] = static_cast<uchar>( qGreen( pixel ));
+                    out[pos++] = static_cast<uchar>( qBlue( pixel ));
+                }
+            } else {
+                out[pos++] = QoiSystem::OpRGBA;
+                out[pos++] = static_cast<uchar>( qRed( pixel ));
+                out[pos++] = static_cast<uchar>( qGreen( pixel ));
+                out[pos++] = static_cast<uchar>( qBlue( pixel ));
+                out[pos++] = static_cast<uchar>( qAlpha( pixel ));
+            }
+            previous = pixel;
+        }
+    }
+
+    if ( run )
+        out[pos++] = QoiSystem::OpRun | static_cast<uchar>( run - 1 );
+
+    // end marker
+    memset( out + pos, 0, QoiSystem::PaddingSize - 1 );
+    pos += QoiSystem::PaddingSize - 1;
+    out[pos++] = 1;
+
+    bytes.resize( pos );
+    return bytes;
+}
+
+/**
+ * @brief Codec::decodeQoi
+ * @param bytes
+ * @return
+ */
+QImage Codec::decodeQoi( const QByteArray &bytes ) {
+    const uchar *in = reinterpret_cast<const uchar *>( bytes.constData());
+    const int end = bytes.size() - QoiSystem::PaddingSize;
+    QRgb index[64], pixel = qRgba( 0, 0, 0, 255 );
+    int width, height, x, y, pos, run = 0;
+
+    if ( bytes.size() < QoiSystem::HeaderSize + QoiSystem::PaddingSize || memcmp( in, "qoif", 4 ))
+        return QImage();
+
+    width = static_cast<int>( qFromBigEndian<quint32>( in + 4 ));
+    height = static_cast<int>( qFromBigEndian<quint32>( in + 8 ));
+    if ( width <= 0 || height <= 0 || width > QoiSystem::MaxDimension || height > QoiSystem::MaxDimension )
+        return QImage();
+
+    QImage image( width, height, QImage::Format_ARGB32 );
+    memset( index, 0, sizeof( index ));
+    pos = QoiSystem::HeaderSize;
+
+    for ( y = 0; y < height; y++ ) {
+        QRgb *line = reinterpret_cast<QRgb *>( image.scanLine( y ));
+
+        for ( x = 0; x < width; x++ ) {
+            if ( run ) {
+                run--;
+            } else if ( pos < end ) {
+                const uchar op = in[pos++];
+
+                // the padding guarantees that multi-byte chunks stay in bounds
+                if ( op == QoiSystem::OpRGB ) {
+                    pixel = qRgba( in[pos], in[pos + 1], in[pos + 2], qAlpha( pixel ));
+                    pos += 3;
+                } else if ( op == QoiSystem::OpRGBA ) {
+                    pixel = qRgba( in[pos], in[pos + 1], in[pos + 2], in[pos + 3] );
+                    pos += 4;
+                } else if (( op & QoiSystem::Mask ) == QoiSystem::OpIndex ) {
+                    pixel = index[op];
+                } else if (( op & QoiSystem::Mask ) == QoiSystem::OpDiff ) {
+                    pixel = qRgba(( qRed( pixel ) + (( op >> 4 ) & 3 ) - 2 ) & 0xff, ( qGreen( pixel ) + (( op >> 2 ) & 3 ) - 2 ) & 0xff, ( qBlue( pixel ) + ( op & 3 ) - 2 ) & 0xff, qAlpha( pixel ));
+                } else if (( op & QoiSystem::Mask ) == QoiSystem::OpLuma ) {
+                    const int dg = ( op & 0x3f ) - 32;
+                    const uchar next = in[pos++];
+
+                    pixel = qRgba(( qRed( pixel ) + dg - 8 + (( next >> 4 ) & 0x0f )) & 0xff, ( qGreen( pixel ) + dg ) & 0xff, ( qBlue( pixel ) + dg - 8 + ( next & 0x0f )) & 0xff, qAlpha( pixel ));
+                } else {
+                    run = op & 0x3f;
+                }
+
+                index[qoiHash( pixel )] = pixel;
+            }
+
+            line[x] = pixel;
+        }
+    }
+
+    return image;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2017 Zvaigznu Planetarijs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#pragma once
+
+//
+// includes
+//
+#include <QByteArray>
+#include <QImage>
+
+/**
+ * @brief The Codec class
+ *
+ * thumbnail encodings: PNG (as before), QOI (lossless, single pass, no
+ * entropy coder - much cheaper to decode than PNG) and JPEG (lossy, for
+ * photos; images with alpha fall back to QOI)
+ */
+class Codec {
+public:
+    enum Codecs {
+        Png = 0,
+        Qoi,
+        Jpeg
+    };
+
+    static QByteArray encode( const QImage &image, Codecs &codec, int quality = -1 );
+    static QImage decode( const QByteArray &bytes, Codecs codec );
+    static QByteArray encodeQoi( const QImage &image );
+    static QImage decodeQoi( const QByteArray &bytes );
+};
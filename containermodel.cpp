@@ -38,6 +38,8 @@
 #include <QInputDialog>
 #include <QMimeData>
 #include <QClipboard>
+#include <QDebug>
+#include <algorithm>
 
 /**
  * @brief ContainerModel::ContainerModel
@@ -50,8 +52,8 @@ ContainerModel::ContainerModel( QAbstractItemView *view, Containers container )
     if ( this->parent() != nullptr )
         this->m_rubberBand = new QRubberBand( QRubberBand::Rectangle, this->parent()->viewport());
 
-    // listen to cache updates
-    this->connect( m.cache, SIGNAL( finished( QString, DataEntry )), this, SLOT( mimeTypeDetected( QString, DataEntry )));
+    // listen to cache updates (batched, about once per frame)
+    this->connect( m.cache, SIGNAL( finished( QStringList, QList<DataEntry> )), this, SLOT( mimeTypesDetected( QStringList, QList<DataEntry> )));
 }
 
 
@@ -59,7 +61,7 @@ ContainerModel::ContainerModel( QAbstractItemView *view, Containers container )
  * @brief ContainerModel::~ContainerModel
  */
 ContainerModel::~ContainerModel() {
-    this->disconnect( m.cache, SIGNAL( finished( QString, DataEntry )));
+    this->disconnect( m.cache, SIGNAL( finished( QStringList, QList<DataEntry> )));
     this->m_rubberBand->deleteLater();
 }
 
@@ -87,6 +89,9 @@ void ContainerModel::reset( bool force ) {
     if ( !this->parent()->isVisible() && !force )
         return;
 
+    // new contents - drop the old queue (cache lives in its own thread, keep requests in order)
+    QMetaObject::invokeMethod( m.cache, "stop", Qt::QueuedConnection );
+
     this->processEntries();
     this->beginResetModel();
     this->endResetModel();
@@ -585,6 +590,9 @@ void ContainerModel::determineMimeTypes() {
     QModelIndex index;
     QRect rect;
     Entry *entry;
+    QStringList fileList;
+    QHash<QString, int> distances;
+    QPoint center;
     int y, k;//, z = 0;
 
     if ( SpecialDirectory::pathToType( pathUtils.currentPath ) != SpecialDirectory::General )
@@ -592,9 +600,9 @@ void ContainerModel::determineMimeTypes() {
 
     // TODO: must read files in batches via QDirIterator from a separate thread?
 
-    // clean up
-    m.cache->stop();
+    // queued files are reprioritized by the cache rather than dropped on scroll
     this->fileHash.clear();
+    center = this->parent()->viewport()->rect().center();
 
     // build file hash
     for ( y = 0; y < this->rowCount(); y++ ) {
@@ -607,13 +615,28 @@ void ContainerModel::determineMimeTypes() {
 
             rect = this->parent()->visualRect( index );
             if ( entry != nullptr && this->parent()->viewport()->rect().intersects( rect )) {
+                const int distance = ( rect.center() - center ).manhattanLength();
+
+                // table columns share the same file
+                if ( !this->fileHash.contains( entry->path())) {
+                    fileList << entry->path();
+                    distances[entry->path()] = distance;
+                } else {
+                    distances[entry->path()] = qMin( distance, distances[entry->path()] );
+                }
+
                 this->fileHash.insert( entry->path(), index );
-                m.cache->process( entry->path());
                 //z++;
             }
         }
     }
 
+    // one request per screen (closest to the center first), cached entries are read in a single sweep
+    if ( !fileList.isEmpty()) {
+        std::stable_sort( fileList.begin(), fileList.end(), [ &distances ]( const QString &a, const QString &b ) { return distances.value( a ) < distances.value( b ); } );
+        QMetaObject::invokeMethod( m.cache, "process", Qt::QueuedConnection, Q_ARG( QStringList, fileList ));
+    }
+
     // report
     //if ( z > 0 )
     //    qDebug() << "about to detect mimetypes of" << z << "files";
@@ -623,8 +646,10 @@ void ContainerModel::determineMimeTypes() {
  * @brief ContainerModel::mimeTypeDetected
  * @param fileName
  * @param entry
+ * @param top first updated row (extended)
+ * @param bottom last updated row (extended)
  */
-void ContainerModel::mimeTypeDetected( const QString &fileName, const DataEntry &data ) {
+void ContainerModel::mimeTypeDetected( const QString &fileName, const DataEntry &data, int &top, int &bottom ) {
     QMimeDatabase mdb;
     int y, index;
 
@@ -643,7 +668,7 @@ void ContainerModel::mimeTypeDetected( const QString &fileName, const DataEntry
         entry = this->indexToEntry( values.at( y ));
         if ( entry != nullptr ) {
             if ( !QString::compare( entry->path(), fileName )) {
-                if ( data.pixmapList.count() == 4 ) {
+                if ( data.count() == 4 ) {
                     index = this->iconSize() / 16;
                     index = 4 - index;
 
@@ -652,7 +677,8 @@ void ContainerModel::mimeTypeDetected( const QString &fileName, const DataEntry
                     else if ( index > 3 )
                         index = 3;
 
-                    entry->setIconPixmap( data.pixmapList.at( index ));
+                    // the only image to pixmap conversion, on the gui thread
+                    entry->setIconPixmap( QPixmap::fromImage( data.image( index )));
 
                     if ( entry->info().fileName().endsWith( ".exe" ))
                         entry->setType( Entry::Executable );
@@ -662,12 +688,31 @@ void ContainerModel::mimeTypeDetected( const QString &fileName, const DataEntry
 
                 entry->setMimeType( mdb.mimeTypeForName( data.mimeType ));
                 entry->setUpdated( true );
-                this->parent()->update( values.at( y ));
+
+                // repainted along with the rest of the batch
+                top = qMin( top, values.at( y ).row());
+                bottom = qMax( bottom, values.at( y ).row());
             }
         }
     }
 }
 
+/**
+ * @brief ContainerModel::mimeTypesDetected
+ * @param fileList
+ * @param entryList
+ */
+void ContainerModel::mimeTypesDetected( const QStringList &fileList, const QList<DataEntry> &entryList ) {
+    int y, top = this->rowCount(), bottom = -1;
+
+    for ( y = 0; y < fileList.count() && y < entryList.count(); y++ )
+        this->mimeTypeDetected( fileList.at( y ), entryList.at( y ), top, bottom );
+
+    // one repaint per batch
+    if ( bottom >= top )
+        emit this->dataChanged( this->index( top, 0 ), this->index( bottom, this->columnCount() - 1 ));
+}
+
 /**
  * @brief ContainerModel::processDropEvent
  * @param index
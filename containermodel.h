@@ -186,9 +186,10 @@ private slots:
     void selectCurrent();
     void deselectCurrent();
     void restoreSelection();
-    void mimeTypeDetected( const QString &fileName, const DataEntry &entry );
+    void mimeTypesDetected( const QStringList &fileList, const QList<DataEntry> &entryList );
 
 private:
+    void mimeTypeDetected( const QString &fileName, const DataEntry &data, int &top, int &bottom );
     QModelIndexList selection;
     QAbstractItemView *m_parent;
     QList<Entry*> list;
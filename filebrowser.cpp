@@ -311,7 +311,7 @@ void FileBrowser::updateInfoPanel() {
                 // get jumbo icon
                 if ( entry->type() == Entry::Executable ) {
                     bool ok;
-                    pixmap = Worker::extractPixmap( entry->path(), ok, true );
+                    pixmap = QPixmap::fromImage( Worker::extractIcon( entry->path(), ok, true ));
 
                     if ( !ok )
                         pixmap = QPixmap();
@@ -20,6 +20,13 @@
 // includes
 //
 #include "filestream.h"
+#ifdef Q_OS_WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
 
 /**
  * @brief FileStream::open
@@ -40,6 +47,7 @@ bool FileStream::open() {
  * @brief FileStream::close
  */
 void FileStream::close() {
+    this->unmap();
     this->unsetDevice();
     this->m_file.close();
 }
@@ -51,19 +59,10 @@ void FileStream::close() {
  * @return
  */
 bool FileStream::seek( FileStream::Origin origin, qint64 position ) {
-    if ( !this->isOpen() || position > this->m_file.size())
+    if ( !this->isOpen() || position < 0 || position > this->m_file.size())
         return false;
 
-    // reset just in case
-    //this->device()->reset();
-
-    if ( this->m_file.pos() < position ) {
-        if ( this->skipRawData( position - this->m_file.pos()) != -1 )
-            return true;
-        else
-            return false;
-    }
-
+    // always an absolute seek (skipping forward would read everything in between)
     switch ( origin ) {
     case Start:
         return this->device()->seek( 0 );
@@ -78,3 +77,69 @@ bool FileStream::seek( FileStream::Origin origin, qint64 position ) {
 
     return false;
 }
+
+/**
+ * @brief FileStream::datasync flushes buffered writes and waits until they reach the disk
+ * @param file
+ * @return
+ */
+bool FileStream::datasync( QFile &file ) {
+    if ( !file.isWritable() || !file.flush())
+        return false;
+
+#ifdef Q_OS_WIN32
+    return FlushFileBuffers( reinterpret_cast<HANDLE>( _get_osfhandle( file.handle()))) != 0;
+#elif defined( Q_OS_MAC )
+    return fsync( file.handle()) == 0;
+#else
+    return fdatasync( file.handle()) == 0;
+#endif
+}
+
+/**
+ * @brief FileStream::advise hints that a range will be read soon (unix only)
+ * @param offset
+ * @param length
+ */
+void FileStream::advise( qint64 offset, qint64 length ) {
+#if defined( Q_OS_UNIX ) && !defined( Q_OS_MAC )
+    if ( this->isOpen())
+        posix_fadvise( this->m_file.handle(), offset, length, POSIX_FADV_WILLNEED );
+#else
+    Q_UNUSED( offset )
+    Q_UNUSED( length )
+#endif
+}
+
+/**
+ * @brief FileStream::map
+ * @return
+ */
+const uchar *FileStream::map() {
+    // drop previous mapping (if any)
+    this->unmap();
+
+    if ( !this->isOpen() || !this->m_file.size())
+        return nullptr;
+
+    // buffered writes must reach the file before it is mapped
+    this->m_file.flush();
+
+    // map the whole file
+    this->m_map = this->m_file.map( 0, this->m_file.size());
+    if ( this->m_map != nullptr )
+        this->m_mapSize = this->m_file.size();
+
+    return this->m_map;
+}
+
+/**
+ * @brief FileStream::unmap
+ */
+void FileStream::unmap() {
+    if ( this->m_map != nullptr )
+        this->m_file.unmap( this->m_map );
+
+    this->m_map = nullptr;
+    this->m_mapSize = 0;
+}
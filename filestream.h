@@ -34,8 +34,8 @@ public:
         Start,
         End
     };
-    FileStream( const QString &filename ) { this->m_file.setFileName( filename ); }
-    FileStream() {}
+    FileStream( const QString &filename ) : m_map( nullptr ), m_mapSize( 0 ) { this->m_file.setFileName( filename ); }
+    FileStream() : m_map( nullptr ), m_mapSize( 0 ) {}
     void setFilename( const QString &filename ) { this->m_file.setFileName( filename ); }
     bool open();
     bool isOpen() { return this->m_file.isWritable(); }
@@ -48,7 +48,16 @@ public:
     void resize( qint64 size ) { this->m_file.resize( size ); }
     void clear() { this->resize( 0 ); }
     void sync() { this->m_file.flush(); }
+    bool datasync() { return FileStream::datasync( this->m_file ); }
+    static bool datasync( QFile &file );
+    void advise( qint64 offset, qint64 length );
+    const uchar *map();
+    void unmap();
+    const uchar *mapped() const { return this->m_map; }
+    qint64 mappedSize() const { return this->m_mapSize; }
 
 private:
     QFile m_file;
+    uchar *m_map;
+    qint64 m_mapSize;
 };
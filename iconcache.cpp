@@ -31,7 +31,7 @@
  * @brief IconCache::IconCache
  * @param path
  */
-IconCache::IconCache( const QString &path ) : m_path( path ), m_valid( true ), m_updateRequested( false ) {
+IconCache::IconCache( const QString &path ) : m_path( path ), m_valid( true ), m_updateRequested( 0 ) {
     this->cacheDir = QDir( this->path());
 
     // check if cache dir exists
@@ -46,21 +46,9 @@ IconCache::IconCache( const QString &path ) : m_path( path ), m_valid( true ), m
         }
     }
 
-    // set up index file
-    this->index.setFilename( cacheDir.absolutePath() + "/" + IconCacheSystem::IndexFilename );
-    if ( !this->index.open()) {
-        qDebug() << this->tr( "IconCache: index file non-writable" );
-        this->shutdown();
-        return;
-    } else {
-        if ( !this->index.size())
-            this->index << IconCacheSystem::Version;
-    }
-
-    // set up data file
-    this->data.setFilename( cacheDir.absolutePath() + "/" + IconCacheSystem::DataFilename );
-    if ( !this->data.open()) {
-        qDebug() << this->tr( "IconCache: data file non-writable" );
+    // set up storage
+    if ( !this->storage.open( cacheDir.absolutePath() + "/" + IconCacheSystem::Filename, IconCacheSystem::Version )) {
+        qDebug() << this->tr( "IconCache: storage non-writable" );
         this->shutdown();
         return;
     }
@@ -78,55 +66,51 @@ IconCache::IconCache( const QString &path ) : m_path( path ), m_valid( true ), m
  * @return
  */
 bool IconCache::read() {
-    QMutexLocker( &this->m_mutex );
-
     // failsafe
     if ( !this->isValid())
         return false;
 
-    // read index file version
-    quint8 version;
-    this->index.toStart();
-    this->index >> version;
-
-    // check version
-    if ( version != IconCacheSystem::Version ) {
-        qDebug() << this->tr( "IconCache::read: version mismatch for index file" );
-        this->shutdown();
+    // check version, convert or start over instead of disabling the cache
+    if ( this->storage.version() != IconCacheSystem::Version && !this->migrate( this->storage.version()))
         return false;
-    }
-
-    // read indexes
-    while ( !this->index.atEnd()) {
-        IconEntry iconEntry;
-        this->index >> iconEntry;
-        this->hash[IconIndex( iconEntry.iconName,iconEntry.scale )] = iconEntry;
-    }
 
     // report
-    qDebug() << this->tr( "IconCache::read: found %1 entries in index file" ).arg( this->hash.count());
+    qDebug() << this->tr( "IconCache::read: found %1 entries in storage" ).arg( this->storage.count());
 
     // return success
     return true;
 }
 
+/**
+ * @brief IconCache::migrate
+ * @param version
+ * @return
+ */
+bool IconCache::migrate( quint8 version ) {
+    // NOTE: version 1 caches (plain streams without frames) are reset on purpose,
+    //       converting them is not worth it; future conversions go here
+    //       (keyed by version, rewriting index and data in place)
+    qDebug() << this->tr( "IconCache::migrate: no conversion from version %1, resetting cache" ).arg( version );
+
+    // icons are cheap to regenerate
+    return this->storage.reset( IconCacheSystem::Version );
+}
+
 /**
  * @brief IconCache::write
  * @param iconName
  * @param iconScale
- * @param pixmap
+ * @param image
  * @return
  */
-bool IconCache::write( const QString &iconName, quint8 iconScale, const QPixmap &pixmap ) {
-    QMutexLocker( &this->m_mutex );
-
+bool IconCache::write( const QString &iconName, quint8 iconScale, const QImage &image ) {
     // failsafe
     if ( !this->isValid())
         return false;
 
     // check hash
-    if ( iconName.isEmpty() || iconScale > IconCacheSystem::IconScales[0] || iconScale < IconCacheSystem::IconScales[IconCacheSystem::NumIconScales-1] || pixmap.isNull()) {
-        qDebug() << this->tr( "IconCache::write: invalid iconName or pixmap" );
+    if ( iconName.isEmpty() || iconScale > IconCacheSystem::IconScales[0] || iconScale < IconCacheSystem::IconScales[IconCacheSystem::NumIconScales-1] || image.isNull()) {
+        qDebug() << this->tr( "IconCache::write: invalid iconName or image" );
         return false;
     }
 
@@ -134,47 +118,32 @@ bool IconCache::write( const QString &iconName, quint8 iconScale, const QPixmap
     if ( this->contains( iconName, iconScale ))
         return true;
 
-    // create new icon entry
-    IconEntry iconEntry( iconName, iconScale, this->data.size());
-    this->index.seek( FileStream::End );
-    this->index << iconEntry;
-
-    // add new enty to list
-    this->hash[IconIndex( iconEntry.iconName, iconEntry.scale )] = iconEntry;
-
-    // create new data entry
-    if ( this->data.seek( FileStream::End )) {
-        this->data << pixmap;
-
-        // flush to disk immediately
-        this->data.sync();
+    // create new entry (committed with the batch, see run())
+    // NOTE: same stream format as the pixmaps stored before (QPixmap is streamed as QImage)
+    QByteArray bytes;
+    QDataStream stream( &bytes, QIODevice::WriteOnly );
+    stream << image;
 
-        // return success
-        return true;
-    }
-
-    return false;
+    return this->storage.insert( IconCache::key( iconName, iconScale ), bytes );
 }
 
 /**
- * @brief IconCache::pixmap
+ * @brief IconCache::image
  * @param iconName
  * @param iconScale
- * @return
+ * @return premultiplied image
  */
-QPixmap IconCache::pixmap( const QString &iconName, quint8 iconScale ) {
-    QPixmap pm;
-
-    QMutexLocker( &this->m_mutex );
-
+QImage IconCache::image( const QString &iconName, quint8 iconScale ) {
+    QImage image;
 
     if ( !this->isValid() || !this->contains( iconName, iconScale ))
-        return pm;
+        return image;
 
-    if( this->data.seek( FileStream::Set, this->hash[IconIndex( iconName, iconScale )].offset ))
-        this->data >> pm;
+    const QByteArray bytes( this->storage.value( IconCache::key( iconName, iconScale )));
+    QDataStream stream( bytes );
+    stream >> image;
 
-    return pm;
+    return image.convertToFormat( QImage::Format_ARGB32_Premultiplied );
 }
 
 /**
@@ -183,37 +152,37 @@ QPixmap IconCache::pixmap( const QString &iconName, quint8 iconScale ) {
 void IconCache::run() {
     // enter event loop
     while ( !this->isInterruptionRequested()) {
-        QMutexLocker( &this->m_mutex );
-
-        // LIFO - prioritizing most recent entries
-        if ( !this->workList.isEmpty()) {
-            IconIndex index;
-            QPixmap pixmap;
-            QString iconName;
-            quint8 iconScale;
-
-            index = this->workList.takeLast();
-            iconName = index.first;
-            iconScale = index.second;
-
-            if ( this->contains( iconName, iconScale )) {
-                emit this->finished( iconName, iconScale, this->pixmap( iconName, iconScale ));
-                continue;
-            }
-            pixmap = m.pixmapCache->pixmap( iconName, iconScale );
-
-            if ( !pixmap.isNull() && pixmap.width()) {
-                // cache to disk
-                this->write( iconName, iconScale, pixmap );
-                emit this->finished( iconName, iconScale, pixmap );
-            }
-        } else {
-            if ( this->updateRequested()) {
-                this->m_updateRequested = false;
+        IconIndex index;
+        QImage image;
+        QString iconName;
+        quint8 iconScale;
+
+        // queue drained - commit the batch
+        if ( this->queue.isEmpty()) {
+            this->storage.flush();
+
+            if ( this->m_updateRequested.testAndSetOrdered( 1, 0 ))
                 emit this->update();
-            }
+        }
+
+        // sleeps until there is work or an update is requested (LIFO - prioritizing most recent entries)
+        if ( !this->queue.take( index ))
+            continue;
 
-            msleep( 100 );
+        iconName = index.first;
+        iconScale = index.second;
+
+        if ( this->contains( iconName, iconScale )) {
+            emit this->finished( iconName, iconScale, this->image( iconName, iconScale ));
+            continue;
+        }
+
+        // images only - pixmaps are made by the receiving model on the gui thread
+        image = m.pixmapCache->image( iconName, iconScale );
+        if ( !image.isNull() && image.width()) {
+            // cache to disk
+            this->write( iconName, iconScale, image );
+            emit this->finished( iconName, iconScale, image );
         }
     }
 }
@@ -222,11 +191,14 @@ void IconCache::run() {
  * @brief IconCache::shutdown
  */
 void IconCache::shutdown() {
-    QMutexLocker( &this->m_mutex );
+    // storage belongs to the thread until it has stopped
+    if ( this->isRunning()) {
+        this->interrupt();
+        this->wait();
+    }
 
     this->setValid( false );
-    this->index.close();
-    this->data.close();
+    this->storage.close();
 }
 
 /**
@@ -234,21 +206,8 @@ void IconCache::shutdown() {
  * @param iconName
  */
 void IconCache::process( const QString &iconName, quint8 iconScale ) {
-    QMutexLocker( &this->m_mutex );
-    IconIndex index;
-
     if ( iconName.isEmpty())
         return;
 
-    index = IconIndex( iconName, iconScale );
-    if ( !this->workList.contains( index ))
-        this->workList << index;
-}
-
-/**
- * @brief IconCache::clear
- */
-void IconCache::clear() {
-    QMutexLocker( &this->m_mutex );
-    this->workList.clear();
+    this->queue.add( IconIndex( iconName, iconScale ), true );
 }
@@ -22,12 +22,13 @@
 // includes
 //
 #include <QDataStream>
-#include <QPixmap>
+#include <QImage>
 #include <QDir>
 #include <QHash>
 #include <QThread>
-#include <QMutex>
-#include "filestream.h"
+#include <QAtomicInt>
+#include "storage.h"
+#include "workqueue.h"
 
 //
 // classes
@@ -38,9 +39,8 @@ class IconFetcher;
  * @brief The IconCacheSystem namespace
  */
 namespace IconCacheSystem {
-    static const quint8 Version = 1;
-    static const QString IndexFilename( "icons.index" );
-    static const QString DataFilename( "icons.data" );
+    static const quint8 Version = 2;
+    static const QString Filename( "icons" );
     static const quint8 NumIconScales = /*4*/1;
     static const quint8 IconScales[NumIconScales] = { /*64, 48, 32,*/ 16 };
 }
@@ -51,20 +51,6 @@ namespace IconCacheSystem {
 typedef QPair<QString, qint8> IconIndex;
 Q_DECLARE_METATYPE( IconIndex )
 
-/**
- * @brief The IconEntry struct
- */
-struct IconEntry {
-    IconEntry( const QString &n = QString::null, quint8 s = IconCacheSystem::IconScales[0], qint64 o = 0 ) : iconName( n ), scale( s ), offset( o ) {}
-    QString iconName;
-    quint8 scale;
-    qint64 offset;
-};
-
-// read/write operators
-inline static QDataStream &operator<<( QDataStream &out, const IconEntry &e ) { out << e.iconName << e.scale << e.offset; return out; }
-inline static QDataStream &operator>>( QDataStream &in, IconEntry &e ) { in >> e.iconName >> e.scale >> e.offset; return in; }
-
 /**
  * @brief The IconCache class
  */
@@ -77,15 +63,16 @@ public:
     IconCache( const QString &path );
     ~IconCache() { this->shutdown(); }
 
-    bool updateRequested() const { QMutexLocker( &this->m_mutex ); return this->m_updateRequested; }
+    bool updateRequested() const { return this->m_updateRequested.load(); }
 
 public slots:
     void process( const QString &iconName, quint8 iconScale );
-    void requestUpdate() { QMutexLocker( &this->m_mutex ); this->clear(); this->m_updateRequested = true; }
-    void clear();
+    void requestUpdate() { this->clear(); this->m_updateRequested.store( 1 ); this->queue.wake(); }
+    void clear() { this->queue.clear(); }
+    void interrupt() { this->requestInterruption(); this->queue.interrupt(); }
 
 signals:
-    void finished( const QString &iconName, quint8 iconScale, const QPixmap &pixmap );
+    void finished( const QString &iconName, quint8 iconScale, const QImage &image );
     void update();
 
 private slots:
@@ -96,25 +83,24 @@ private:
     Q_DISABLE_COPY( IconCache )
     QString path() const { return this->m_path; }
     bool isValid() const { return this->m_valid; }
-    bool write( const QString &iconName, quint8 iconScale, const QPixmap &pixmap );
-    bool contains( const QString &iconName, quint8 iconScale ) const { QMutexLocker( &this->m_mutex ); return this->hash.contains( IconIndex( iconName, iconScale )); }
+    bool write( const QString &iconName, quint8 iconScale, const QImage &image );
+    bool contains( const QString &iconName, quint8 iconScale ) const { return this->storage.contains( IconCache::key( iconName, iconScale )); }
+    static QByteArray key( const QString &iconName, quint8 iconScale ) { return iconName.toUtf8() + '\0' + static_cast<char>( iconScale ); }
     bool read();
-    FileStream index;
-    FileStream data;
+    bool migrate( quint8 version );
+    Storage storage;
     QString m_path;
-    QHash<IconIndex, IconEntry> hash;
-    QPixmap pixmap( const QString &iconName, quint8 iconScale );
+    QImage image( const QString &iconName, quint8 iconScale );
 
     bool m_valid;
     QDir cacheDir;
     IconFetcher *iconFetcher;
 
+    // storage is used by the cache thread only (once started)
     void run();
-    QList<IconIndex> workList;
-
-    mutable QMutex m_mutex;
+    WorkQueue<IconIndex> queue;
 
-    bool m_updateRequested;
+    QAtomicInt m_updateRequested;
 };
 
 
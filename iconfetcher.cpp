@@ -28,42 +28,23 @@
 // FIXME: with the new pixmap cache, this also lists missing icons
 //
 
-/**
- * @brief IconFetcher::addWork
- * @param iconName
- * @param iconScale
- */
-void IconFetcher::addWork( const QString &iconName, quint8 iconScale ) {
-    QMutexLocker( &this->m_mutex );
-    IconIndex index;
-
-    index = IconIndex( iconName, iconScale );
-    if ( !this->workList.contains( index ))
-        this->workList << index;
-}
-
 /**
  * @brief IconFetcher::run
  */
 void IconFetcher::run() {
     // enter event loop
     while ( !this->isInterruptionRequested()) {
-        QMutexLocker( &this->m_mutex );
-
-        // LIFO - prioritizing most recent entries
-        if ( !this->workList.isEmpty()) {
-            IconIndex index;
-            QPixmap pixmap;
+        IconIndex index;
+        QImage image;
 
-            index = this->workList.takeLast();
+        // sleeps until there is work (LIFO - prioritizing most recent entries)
+        if ( !this->queue.take( index ))
+            continue;
 
-            // NOTE: we can afford non-efficient fetch via findPixmap
-            pixmap = m.pixmapCache->findPixmap( index.first, index.second );
+        // NOTE: we can afford non-efficient fetch (images only, off the gui thread)
+        image = m.pixmapCache->image( index.first, index.second );
 
-            if ( !pixmap.isNull() && pixmap.width())
-                emit this->workDone( index.first, index.second, pixmap );
-        } else {
-            msleep( 100 );
-        }
+        if ( !image.isNull() && image.width())
+            emit this->workDone( index.first, index.second, image );
     }
 }
@@ -22,10 +22,10 @@
 // includes
 //
 #include <QThread>
-#include <QMutex>
 #include <QDebug>
-#include <QPixmap>
+#include <QImage>
 #include "iconcache.h"
+#include "workqueue.h"
 
 /**
  * @brief The IconFetcher class
@@ -34,14 +34,14 @@ class IconFetcher : public QThread {
     Q_OBJECT
 
 public slots:
-    void clear() { QMutexLocker( &this->m_mutex ); this->workList.clear(); }
-    void addWork( const QString &iconName, quint8 iconScale );
+    void clear() { this->queue.clear(); }
+    void addWork( const QString &iconName, quint8 iconScale ) { this->queue.add( IconIndex( iconName, iconScale ), true ); }
+    void interrupt() { this->requestInterruption(); this->queue.interrupt(); }
 
 signals:
-    void workDone( const QString &, quint8, const QPixmap & );
+    void workDone( const QString &, quint8, const QImage & );
 
 private:
     void run();
-    QList<IconIndex> workList;
-    mutable QMutex m_mutex;
+    WorkQueue<IconIndex> queue;
 };
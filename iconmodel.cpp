@@ -39,7 +39,7 @@ IconModel::IconModel( QObject *listView ) {
         return;
 
     // listen to cache updates
-    this->connect( m.iconCache, SIGNAL( finished( QString, quint8, QPixmap )), this, SLOT( iconFetched( QString, quint8, QPixmap )));
+    this->connect( m.iconCache, SIGNAL( finished( QString, quint8, QImage )), this, SLOT( iconFetched( QString, quint8, QImage )));
     this->connect( m.iconCache, SIGNAL( update()), this, SLOT( fetch()));
 
    // // reset model
@@ -104,11 +104,11 @@ void IconModel::addIcon( const QString &iconName, const QPixmap &pixmap ) {
  * @brief IconModel::iconFetched
  * @param iconName
  * @param iconScale
- * @param pixmap
+ * @param image
  */
-void IconModel::iconFetched( const QString &iconName, quint8, const QPixmap &pixmap ) {
+void IconModel::iconFetched( const QString &iconName, quint8, const QImage &image ) {
     // TODO: must ignore when stopped
-    this->addIcon( iconName, pixmap );
+    this->addIcon( iconName, QPixmap::fromImage( image ));
 }
 
 /**
@@ -46,7 +46,7 @@ public slots:
     void fetch();
 
 private slots:
-    void iconFetched( const QString &iconName, quint8 iconScale, const QPixmap & );
+    void iconFetched( const QString &iconName, quint8 iconScale, const QImage & );
 
 private:
     QListView *parent;
@@ -21,27 +21,190 @@
 //
 #include "indexer.h"
 #include "cache.h"
+#include "checksum.h"
+#include <QtEndian>
+#if defined( Q_OS_UNIX ) && !defined( Q_OS_MAC )
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#define INDEXER_FADVISE
+#endif
+
+/**
+ * @brief Indexer::readAhead starts fetching the hashed part of the file into the page cache
+ * @param fileName
+ */
+void Indexer::readAhead( const QString &fileName ) const {
+#ifdef INDEXER_FADVISE
+    struct stat info;
+    int fd, y;
+
+    fd = ::open( QFile::encodeName( fileName ).constData(), O_RDONLY );
+    if ( fd < 0 )
+        return;
+
+    if ( !fstat( fd, &info ) && this->policy.sampled( info.st_size )) {
+        for ( y = 0; y < this->policy.chunks; y++ )
+            posix_fadvise( fd, this->policy.sampleOffset( info.st_size, y ), this->policy.chunkSize, POSIX_FADV_WILLNEED );
+    } else {
+        posix_fadvise( fd, 0, CacheSystem::MaxFileSize, POSIX_FADV_WILLNEED );
+    }
+    ::close( fd );
+#else
+    Q_UNUSED( fileName )
+#endif
+}
+
+/**
+ * @brief Indexer::release drops file pages once nothing else will read them
+ * @param fileName
+ */
+void Indexer::release( const QString &fileName ) {
+#ifdef INDEXER_FADVISE
+    int fd;
+
+    fd = ::open( QFile::encodeName( fileName ).constData(), O_RDONLY );
+    if ( fd < 0 )
+        return;
+
+    posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+    ::close( fd );
+#else
+    Q_UNUSED( fileName )
+#endif
+}
+
+/**
+ * @brief Indexer::sample hashes evenly spaced chunks, size and mtime of a large file
+ * @param file
+ * @param size
+ * @param stream
+ * @return
+ */
+bool Indexer::sample( QFile &file, qint64 size, Checksum::Stream &stream ) {
+    StatKey key;
+    qint64 bytes;
+    uchar trailer[16];
+    int y;
+
+    // mtime makes up for the unread parts
+    if ( !Storage::statKey( file.fileName(), key ))
+        return false;
+
+    for ( y = 0; y < this->policy.chunks; y++ ) {
+        if ( !file.seek( this->policy.sampleOffset( size, y )))
+            return false;
+
+        bytes = file.read( this->buffer.data(), qMin( static_cast<qint64>( this->policy.chunkSize ), static_cast<qint64>( this->buffer.size())));
+        if ( bytes <= 0 )
+            return false;
+
+        SourceBuffer::count( bytes );
+
+        stream.update( this->buffer.constData(), static_cast<size_t>( bytes ));
+    }
+
+    qToBigEndian( static_cast<quint64>( size ), trailer );
+    qToBigEndian( static_cast<quint64>( key.mtime ), trailer + 8 );
+    stream.update( reinterpret_cast<const char *>( trailer ), sizeof( trailer ));
+
+    return true;
+}
 
 /**
  * @brief Indexer::work
  * @param fileName
+ * @param legacyHash version 2 checksum (only while migrating, otherwise 0)
+ * @param token checked between reads
+ * @param source if set, receives the contents for decoding (files up to 10MB, within the buffer budget)
  * @return
  */
-Hash Indexer::work( const QString &fileName ) {
-    quint32 hash = 0;
+Hash Indexer::work( const QString &fileName, quint32 &legacyHash, const WorkToken &token, QSharedPointer<SourceBuffer> *source ) {
+    Checksum::Stream stream;
+    Checksum::Legacy legacyStream;
     QFile file( fileName );
+    qint64 size = 0, remaining, bytes, offset = 0;
+    const bool migrating = this->legacy.load();
+    QSharedPointer<SourceBuffer> contents;
+
+    legacyHash = 0;
+
+    if ( token.isCancelled())
+        return Hash();
 
     if ( file.open( QFile::ReadOnly )) {
-        // read the first 10MB and assume files are identical
-        if ( file.size() >= CacheSystem::MaxFileSize )
-            hash = Cache::checksum( file.read( CacheSystem::MaxFileSize ).constData(), CacheSystem::MaxFileSize );
-        else
-            hash = Cache::checksum( file.readAll().constData(), file.size());
+        size = file.size();
+
+        // large files are identified by a few small reads
+        if ( this->policy.sampled( size )) {
+            if ( !this->sample( file, size, stream ))
+                size = 0;
+
+#ifdef INDEXER_FADVISE
+            posix_fadvise( file.handle(), 0, 0, POSIX_FADV_DONTNEED );
+#endif
+            file.close();
+            return Hash( size ? stream.digest() : 0, size );
+        }
+
+#ifdef INDEXER_FADVISE
+        posix_fadvise( file.handle(), 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+
+        // read up to the first 10MB (unless the policy samples them) and assume files are identical
+        // NOTE: hashed through a fixed buffer (or straight into the buffer handed to the worker),
+        //       so memory use does not depend on file size
+        remaining = qMin( size, CacheSystem::MaxFileSize );
+        if ( source != nullptr )
+            contents = SourceBuffer::reserve( size );
+
+        while ( remaining > 0 && !token.isCancelled()) {
+            char *chunk = contents.isNull() ? this->buffer.data() : contents->bytes.data() + offset;
+
+            bytes = file.read( chunk, qMin( remaining, static_cast<qint64>( this->buffer.size())));
+            if ( bytes <= 0 )
+                break;
+
+            SourceBuffer::count( bytes );
+            stream.update( chunk, static_cast<size_t>( bytes ));
+            if ( migrating )
+                legacyStream.update( chunk, static_cast<size_t>( bytes ));
+            remaining -= bytes;
+            offset += bytes;
+        }
+
+        // complete reads only
+        if ( !contents.isNull() && !remaining && offset == size )
+            *source = contents;
+
+        // same pass, old cache entries are found without rereading the file
+        if ( migrating && !remaining )
+            legacyHash = legacyStream.digest();
+
+#ifdef INDEXER_FADVISE
+        // large files are never decoded, so their pages are of no further use
+        if ( size > CacheSystem::MaxFileSize )
+            posix_fadvise( file.handle(), 0, 0, POSIX_FADV_DONTNEED );
+#endif
 
         file.close();
     }
 
-    return Hash( hash, file.size());
+    return Hash( stream.digest(), size );
+}
+
+/**
+ * @brief Indexer::prefetch hints the files that are next in line
+ */
+void Indexer::prefetch() {
+    QStringList next;
+
+    foreach ( const Work &work, this->pool->queue( this->index )->next( CacheSystem::ReadAheadFiles )) {
+        if ( !this->advised.contains( work.fileName ))
+            Indexer::readAhead( work.fileName );
+        next << work.fileName;
+    }
+    this->advised = next;
 }
 
 /**
@@ -50,15 +213,22 @@ Hash Indexer::work( const QString &fileName ) {
 void Indexer::run() {
     // enter event loop
     while ( !this->isInterruptionRequested()) {
-        QMutexLocker( &this->m_mutex );
-
-        // LIFO - prioritizing most recent entries
-        if ( !this->workList.isEmpty()) {
-            QString fileName;
-            fileName = this->workList.takeLast();
-            emit this->workDone( fileName, this->work( fileName ));
-        } else {
-            msleep( 100 );
+        quint32 legacyHash;
+        Work work;
+
+        // sleeps until there is work (most urgent - closest to the viewport center - first)
+        if ( !this->pool->take( this->index, work ))
+            continue;
+
+        // a directory we already left
+        const WorkToken token( this->generation, work.generation );
+        this->prefetch();
+        work.hash = this->work( work.fileName, legacyHash, token, &work.source );
+        if ( token.isCancelled()) {
+            Indexer::release( work.fileName );
+            continue;
         }
+
+        emit this->workDone( work, legacyHash );
     }
 }
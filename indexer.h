@@ -22,9 +22,10 @@
 // includes
 //
 #include <QThread>
-#include <QMutex>
+#include <QAtomicInt>
 #include <QDebug>
 #include "cache.h"
+#include "workqueue.h"
 
 /**
  * @brief The Indexer class
@@ -33,19 +34,27 @@ class Indexer : public QThread {
     Q_OBJECT
 
 public:
-    Indexer() {}
+    Indexer( const HashPolicy &policy = HashPolicy(), WorkPool<Work> *pool = nullptr, int index = 0, const QAtomicInt *generation = nullptr ) : pool( pool ), index( index ), generation( generation ), policy( policy ), buffer( CacheSystem::ReadBufferSize, Qt::Uninitialized ) {}
+    static void release( const QString &fileName );
+    Hash work( const QString &fileName, quint32 &legacyHash, const WorkToken &token = WorkToken(), QSharedPointer<SourceBuffer> *source = nullptr );
 
 public slots:
-    void addWork( const QString &fileName ) { QMutexLocker( &this->m_mutex ); this->workList << fileName; }
-    void addWork( const QStringList &fileList ) { QMutexLocker( &this->m_mutex ); this->workList << fileList; }
-    void clear() { QMutexLocker( &this->m_mutex ); this->workList.clear(); }
+    void interrupt() { this->requestInterruption(); this->pool->queue( this->index )->interrupt(); }
+    void setLegacy( bool enable ) { this->legacy.store( enable ); }
 
 signals:
-    void workDone( const QString &fileName, const Hash & );
+    void workDone( const Work &, quint32 legacy );
 
 private:
     void run();
-    Hash work( const QString &fileName );
-    QStringList workList;
-    mutable QMutex m_mutex;
+    bool sample( QFile &file, qint64 size, Checksum::Stream &stream );
+    void readAhead( const QString &fileName ) const;
+    void prefetch();
+    WorkPool<Work> *pool;
+    int index;
+    const QAtomicInt *generation;
+    QStringList advised;
+    HashPolicy policy;
+    QByteArray buffer;
+    QAtomicInt legacy;
 };
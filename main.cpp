@@ -27,6 +27,7 @@
 #include <QThread>
 #include <QDebug>
 #include <QDesktopWidget>
+#include <QCommandLineParser>
 #include "main.h"
 #include "mainwindow.h"
 #include "pixmapcache.h"
@@ -62,10 +63,51 @@ int main( int argc, char *argv[] ) {
     // register metatypes
     qRegisterMetaType<Hash>( "Hash" );
     qRegisterMetaType<DataEntry>( "DataEntry" );
+    qRegisterMetaType<QList<DataEntry> >( "QList<DataEntry>" );
     qRegisterMetaType<Work>( "Work" );
-    qRegisterMetaType<IconEntry>( "IconEntry" );
     qRegisterMetaType<IconIndex>( "IconIndex" );
-    qRegisterMetaType<PixmapEntry>( "PixmapEntry" );
+
+    // cache packs (no gui):
+    //   --export-pack <pack> <directory> - entries of all files under directory, uncached ones are generated
+    //   --import-pack <pack>             - merges entries into the cache
+    QCommandLineParser parser;
+    QCommandLineOption exportOption( "export-pack", QObject::tr( "Export cache entries of files under <directory> to <pack>." ), "pack" );
+    QCommandLineOption importOption( "import-pack", QObject::tr( "Import cache entries from <pack>." ), "pack" );
+    const QCommandLineOption helpOption( parser.addHelpOption());
+    parser.addOption( exportOption );
+    parser.addOption( importOption );
+    parser.addPositionalArgument( "directory", QObject::tr( "Directory to export." ), "[directory]" );
+
+    // unknown arguments only matter to the pack commands, the gui starts regardless
+    const bool parsed = parser.parse( a.arguments());
+    if ( parser.isSet( helpOption ))
+        parser.showHelp();
+
+    if ( parser.isSet( exportOption ) || parser.isSet( importOption )) {
+        int count;
+
+        if ( !parsed ) {
+            qDebug() << parser.errorText();
+            return 1;
+        }
+
+        if ( parser.isSet( exportOption ) && parser.positionalArguments().isEmpty()) {
+            qDebug() << QObject::tr( "--export-pack: missing <directory>" );
+            return 1;
+        }
+
+        m.cache = new Cache( QDir::homePath() + "/.filemanager/cache" );
+        if ( parser.isSet( exportOption ))
+            count = m.cache->exportPack( parser.positionalArguments().value( 0 ), parser.value( exportOption ));
+        else
+            count = m.cache->importPack( parser.value( importOption ));
+
+        // shut down right away (commits the last batch, releases locks)
+        delete m.cache;
+        m.cache = nullptr;
+
+        return count < 0 ? 1 : 0;
+    }
 
     // set up icon theme
 #ifdef Q_OS_WIN32
@@ -90,10 +132,13 @@ int main( int argc, char *argv[] ) {
     m.cache->moveToThread( &thread );
     thread.connect( qApp, SIGNAL( aboutToQuit()), SLOT( quit()));
     thread.start();
-    m.iconCache->connect( qApp, SIGNAL( aboutToQuit()), SLOT( quit()));
+    m.iconCache->connect( qApp, SIGNAL( aboutToQuit()), SLOT( interrupt()));
     m.iconCache->start();
 #endif
 
+    // commit icon lookups found during this session
+    m.pixmapCache->connect( qApp, SIGNAL( aboutToQuit()), SLOT( flush()));
+
     // style app
     QApplication::setStyle( QStyleFactory::create( "Fusion" ));
 
@@ -126,7 +171,7 @@ int main( int argc, char *argv[] ) {
 /**
  * @brief Main::Main
  */
-Main::Main() {
+Main::Main() : cache( nullptr ), iconCache( nullptr ), pixmapCache( nullptr ), m_gui( nullptr ), m_notifications( nullptr ) {
     this->settings = new QSettings( QDir::homePath() + "/.filemanager/settings.conf", QSettings::IniFormat );
 }
 
@@ -135,7 +180,12 @@ Main::Main() {
  */
 Main::~Main() {
     delete this->settings;
-    this->cache->deleteLater();
-    this->iconCache->deleteLater();
-    this->pixmapCache->deleteLater();
+
+    // command line runs create the cache only
+    if ( this->cache != nullptr )
+        this->cache->deleteLater();
+    if ( this->iconCache != nullptr )
+        this->iconCache->deleteLater();
+    if ( this->pixmapCache != nullptr )
+        this->pixmapCache->deleteLater();
 }
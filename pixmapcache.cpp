@@ -52,15 +52,11 @@ PixmapCache::PixmapCache( const QString &path ) : m_path( path ), m_valid( true
         }
     }
 
-    // set up index file
-    this->indexFile.setFilename( cacheDir.absolutePath() + "/" + PixmapCacheSystem::IndexFilename );
-    if ( !this->indexFile.open()) {
-        qDebug() << this->tr( "PixmapCache: index file non-writable" );
+    // set up storage
+    if ( !this->storage.open( cacheDir.absolutePath() + "/" + PixmapCacheSystem::Filename, PixmapCacheSystem::Version )) {
+        qDebug() << this->tr( "PixmapCache: storage non-writable" );
         this->shutdown();
         return;
-    } else {
-        if ( !this->indexFile.size())
-            this->indexFile << PixmapCacheSystem::Version;
     }
 
     // reead data
@@ -80,32 +76,31 @@ bool PixmapCache::read() {
     if ( !this->isValid())
         return false;
 
-    // read index file version
-    quint8 version;
-    this->indexFile.toStart();
-    this->indexFile >> version;
-
-    // check version
-    if ( version != PixmapCacheSystem::Version ) {
-        qDebug() << this->tr( "PixmapCache::read: version mismatch for index file" );
-        this->shutdown();
+    // check version, convert or start over instead of disabling the cache
+    if ( this->storage.version() != PixmapCacheSystem::Version && !this->migrate( this->storage.version()))
         return false;
-    }
-
-    // read indexes
-    while ( !this->indexFile.atEnd()) {
-        PixmapEntry pixmapEntry;
-        this->indexFile >> pixmapEntry;
-        this->hash[pixmapEntry.cachedName] = pixmapEntry;
-    }
 
     // report
-    qDebug() << this->tr( "PixmapCache::read: found %1 entries in index file" ).arg( this->hash.count());
+    qDebug() << this->tr( "PixmapCache::read: found %1 entries in storage" ).arg( this->storage.count());
 
     // return success
     return true;
 }
 
+/**
+ * @brief PixmapCache::migrate
+ * @param version
+ * @return
+ */
+bool PixmapCache::migrate( quint8 version ) {
+    // NOTE: version 1 caches (plain streams without frames) are reset on purpose,
+    //       converting them is not worth it; future conversions go here
+    qDebug() << this->tr( "PixmapCache::migrate: no conversion from version %1, resetting cache" ).arg( version );
+
+    // only icon file names, rebuilt by buildIndex()
+    return this->storage.reset( PixmapCacheSystem::Version );
+}
+
 /**
  * @brief PixmapCache::write
  * @param iconName
@@ -135,29 +130,22 @@ bool PixmapCache::write( const QString &iconName, const QString &themeName, int
     cachedName = QString( "%1_%2_%3" ).arg( iconName ).arg( themeName ).arg( iconScale );//iconName + "_" + themeName + "_" + iconScale;
 
     // check for duplicates
-    if ( this->contains( cachedName ))
+    QMutexLocker locker( &this->mutex );
+    if ( this->storage.contains( cachedName.toUtf8()))
         return true;
 
-    // create new pixmap entry
-    PixmapEntry pixmapEntry( cachedName, fileName );
-    this->indexFile.seek( FileStream::End );
-    this->indexFile << pixmapEntry;
-
-    // add new enty to list
-    this->hash[pixmapEntry.cachedName] = pixmapEntry;
-
-    // flush to disk immediately
-    this->indexFile.sync();
-
-    return true;
+    // create new entry (committed in batches, see flush())
+    return this->storage.insert( cachedName.toUtf8(), fileName.toUtf8());
 }
 
 /**
  * @brief PixmapCache::shutdown
  */
 void PixmapCache::shutdown() {
+    QMutexLocker locker( &this->mutex );
+
     this->setValid( false );
-    this->indexFile.close();
+    this->storage.close();
 }
 
 /**
@@ -175,9 +163,9 @@ QPixmap PixmapCache::pixmap( const QString &name, int scale, const QString theme
     // search in hash table for LOADED PIXMAPs
     if ( !this->pixmapCache.contains( cachedName )) {
         // if none are loaded, resolve paths from FILENAME CACHE
-        if ( this->hash.contains( cachedName )) {
+        if ( this->contains( cachedName )) {
             // load pixmap filename and add it to LOADED PIXMAP cache
-            pixmap.load( this->hash[cachedName].fileName );
+            pixmap.load( this->fileName( cachedName ));
             if ( !pixmap.isNull()) {
                 this->pixmapCache[cachedName] = pixmap;
                 return pixmap;
@@ -260,9 +248,9 @@ QIcon PixmapCache::icon( const QString &name, int scale, const QString themeName
     // search in hash table
     if ( !this->iconCache.contains( cachedName )) {
         // if none are loaded, resolve paths from FILENAME CACHE
-        if ( this->hash.contains( cachedName )) {
+        if ( this->contains( cachedName )) {
             // load pixmap filename and add it to LOADED PIXMAP cache
-            icon = QIcon( this->hash[cachedName].fileName );
+            icon = QIcon( this->fileName( cachedName ));
             if ( !icon.isNull())
                 return icon;
         }
@@ -478,11 +466,59 @@ IconMatch PixmapCache::readIconFile( const QString &fileName, bool &ok, int recu
 }
 
 /**
- * @brief PixmapCache::findIcon
+ * @brief PixmapCache::findPixmap
  * @param name
  * @return
  */
 QPixmap PixmapCache::findPixmap( const QString &name, int scale, const QString &themeName ) {
+    const QString fileName( this->findFileName( name, scale, themeName ));
+
+    // don't bother if no matches
+    if ( fileName.isEmpty())
+        return QPixmap();
+
+    // return best pixmap
+    return QPixmap( fileName ).scaled( scale, scale, Qt::IgnoreAspectRatio, Qt::SmoothTransformation );
+}
+
+/**
+ * @brief PixmapCache::image loads an icon as a premultiplied image (no pixmaps, usable off the gui thread)
+ * @param name
+ * @param scale
+ * @param themeName
+ * @return
+ */
+QImage PixmapCache::image( const QString &name, int scale, const QString &themeName ) {
+    const QString cachedName( QString( "%1_%2_%3" ).arg( name ).arg( themeName ).arg( scale ));
+    QImage image;
+
+    // resolved before
+    if ( this->contains( cachedName ))
+        image.load( this->fileName( cachedName ));
+
+    // best match, missing icons replaced by the placeholder
+    if ( image.isNull())
+        image.load( this->findFileName( name, scale, themeName ));
+    if ( image.isNull())
+        image.load( this->findFileName( "application-x-zerosize", scale, themeName ));
+    if ( image.isNull())
+        return image;
+
+    image = image.convertToFormat( QImage::Format_ARGB32_Premultiplied );
+    if ( image.width() != scale || image.height() != scale )
+        image = image.scaled( scale, scale, Qt::IgnoreAspectRatio, Qt::SmoothTransformation );
+
+    return image;
+}
+
+/**
+ * @brief PixmapCache::findFileName
+ * @param name
+ * @param scale
+ * @param themeName
+ * @return file name of the best matching icon
+ */
+QString PixmapCache::findFileName( const QString &name, int scale, const QString &themeName ) {
     int y = 0, bestIndex = 0, bestScale = 0;
     IconMatchList matchList;
 
@@ -491,7 +527,7 @@ QPixmap PixmapCache::findPixmap( const QString &name, int scale, const QString &
 
     // don't bother if no matches
     if ( matchList.isEmpty())
-        return QPixmap();
+        return QString();
 
     // go through all matches
     foreach ( IconMatch iconMatch, matchList ) {
@@ -511,8 +547,7 @@ QPixmap PixmapCache::findPixmap( const QString &name, int scale, const QString &
     if ( scale >= 0 )
         this->write( name, themeName, scale, matchList.at( bestIndex ).fileName );
 
-    // return best pixmap
-    return QPixmap( matchList.at( bestIndex ).fileName ).scaled( scale, scale, Qt::IgnoreAspectRatio, Qt::SmoothTransformation );
+    return matchList.at( bestIndex ).fileName;
 }
 
 /**
@@ -22,35 +22,21 @@
 // includes
 //
 #include <QPixmap>
+#include <QImage>
 #include <QHash>
 #include <QDir>
 #include <QIcon>
-#include "filestream.h"
+#include <QMutex>
+#include "storage.h"
 
 /**
  * @brief The PixmapCacheSystem namespace
  */
 namespace PixmapCacheSystem {
-    static const quint8 Version = 1;
-    static const QString IndexFilename( "pixmaps.index" );
+    static const quint8 Version = 2;
+    static const QString Filename( "pixmaps" );
 }
 
-/**
- * @brief The PixmapEntry struct
- */
-struct PixmapEntry {
-    PixmapEntry( const QString &c = QString::null,
-                 const QString &f = QString::null
-                 ) : cachedName( c ), fileName( f ) {}
-    QString cachedName;
-    QString fileName;
-};
-Q_DECLARE_METATYPE( PixmapEntry )
-
-// read/write operators
-inline static QDataStream &operator<<( QDataStream &out, const PixmapEntry &e ) { out << e.cachedName << e.fileName; return out; }
-inline static QDataStream &operator>>( QDataStream &in, PixmapEntry &e ) { in >> e.cachedName >> e.fileName; return in; }
-
 /**
  * @brief The IconMatch struct
  */
@@ -79,6 +65,11 @@ public:
     IconMatchList getIconMatchList( const QString &name, const QString &themeName );
     QIcon findIcon( const QString &name, int scale = 0, const QString &themeName = QString::null );
     QPixmap findPixmap( const QString &name, int scale, const QString &themeName = QString::null );
+    QImage image( const QString &name, int scale, const QString &themeName = QString::null );
+    QString findFileName( const QString &name, int scale, const QString &themeName = QString::null );
+
+public slots:
+    void flush() { QMutexLocker locker( &this->mutex ); this->storage.flush(); }
 
 private slots:
     void setValid( bool valid ) { this->m_valid = valid; }
@@ -94,11 +85,13 @@ private:
     QString path() const { return this->m_path; }
     bool isValid() const { return this->m_valid; }
     bool write( const QString &iconName, const QString &themeName, int iconScale, const QString &fileName );
-    bool contains( const QString &cachedName ) const { return this->hash.contains( cachedName ); }
+    bool contains( const QString &cachedName ) const { QMutexLocker locker( &this->mutex ); return this->storage.contains( cachedName.toUtf8()); }
+    QString fileName( const QString &cachedName ) { QMutexLocker locker( &this->mutex ); return QString::fromUtf8( this->storage.value( cachedName.toUtf8())); }
     bool read();
-    FileStream indexFile;
+    bool migrate( quint8 version );
+    Storage storage;
+    mutable QMutex mutex; // storage is shared by the gui thread and icon fetchers (value() may remap)
     QString m_path;
-    QHash<QString, PixmapEntry> hash;
     bool m_valid;
     QDir cacheDir;
 };
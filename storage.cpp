@@ -0,0 +1,636 @@
+/*
+ * Copyright (C) 2017 Zvaigznu Planetarijs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+//
+// includes
+//
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QObject>
+#include <QtEndian>
+#include "storage.h"
+#ifdef Q_OS_WIN32
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+/*
+  layout:
+    name.index - version, then frames of ( key, data offset, frame length )
+    name.data - frames of values
+    name.lock - held by the instance appending a batch
+
+  a frame is ( payload length, crc32 of payload, payload ); the data file is
+  synced before the index, so an intact index record always points at an
+  intact data frame; a later record of the same key overrides the earlier one
+
+  batches are buffered with offsets relative to the batch and placed at the
+  end of the data file only once the lock is held, so records of instances
+  sharing the files never point at each other's frames
+*/
+
+/**
+ * @brief Storage::open
+ * @param fileName path without suffix
+ * @param version expected version (see version() for the one found)
+ * @return
+ */
+bool Storage::open( const QString &fileName, quint8 version ) {
+    const QFileInfo info( fileName );
+    bool ok;
+
+    this->close();
+    this->m_fileName = fileName;
+
+    this->writerLock.setFileName( fileName + StorageSystem::LockSuffix );
+    if ( !this->lock())
+        return false;
+
+    // finish (or discard) an interrupted compaction
+    Storage::commit( info.absolutePath(), QStringList() << info.fileName() + StorageSystem::IndexSuffix << info.fileName() + StorageSystem::DataSuffix, info.fileName() + StorageSystem::CommitSuffix );
+
+    this->index.setFilename( fileName + StorageSystem::IndexSuffix );
+    this->data.setFilename( fileName + StorageSystem::DataSuffix );
+    if ( !this->index.open() || !this->data.open()) {
+        this->unlock();
+        this->close();
+        return false;
+    }
+    this->identify();
+
+    // new store
+    if ( !this->index.size()) {
+        ok = this->reset( version );
+        this->unlock();
+        return ok;
+    }
+
+    this->index.toStart();
+    this->index >> this->m_version;
+
+    // other layouts are left to the owner to convert (or reset)
+    ok = this->m_version != version || this->read();
+    this->unlock();
+
+    return ok;
+}
+
+/**
+ * @brief Storage::close
+ */
+void Storage::close() {
+    this->flush();
+    this->index.close();
+    this->data.close();
+    this->entries.clear();
+    this->pendingEntries.clear();
+    this->pendingData.clear();
+    this->pendingCount = 0;
+    this->deadBytes = 0;
+    this->indexPos = 0;
+}
+
+/**
+ * @brief Storage::read replays the index
+ * @return
+ */
+bool Storage::read() {
+    this->entries.clear();
+    this->deadBytes = 0;
+    this->indexPos = StorageSystem::IndexHeaderSize;
+    if ( !this->refresh())
+        return false;
+
+    // reclaim overwritten values
+    if ( this->deadBytes * 100 > this->data.size() * StorageSystem::CompactionRatio )
+        return this->compact();
+
+    return true;
+}
+
+/**
+ * @brief Storage::refresh replays index records appended since the last read (with the lock held)
+ * @return
+ */
+bool Storage::refresh() {
+    QByteArray bytes;
+    qint64 pos = 0, skipped = 0;
+
+    // compacted or reset by another instance
+    if ( Storage::replaced( this->m_fileName + StorageSystem::IndexSuffix, this->indexKey ) || Storage::replaced( this->m_fileName + StorageSystem::DataSuffix, this->dataKey )) {
+        this->index.close();
+        this->data.close();
+        if ( !this->index.open() || !this->data.open())
+            return false;
+        this->identify();
+
+        this->entries.clear();
+        this->deadBytes = 0;
+        this->indexPos = StorageSystem::IndexHeaderSize;
+    }
+
+    if ( this->index.size() <= this->indexPos )
+        return true;
+
+    bytes.resize( static_cast<int>( this->index.size() - this->indexPos ));
+    if ( !this->index.setPos( this->indexPos ) || this->index.readRawData( bytes.data(), bytes.size()) != bytes.size()) {
+        this->index.resetStatus();
+        return false;
+    }
+
+    // torn frames (left by a crash) are skipped up to the next intact one
+    while ( pos + StorageSystem::FrameHeaderSize <= bytes.size()) {
+        const qint64 length = StorageSystem::FrameHeaderSize + qFromBigEndian<quint32>( reinterpret_cast<const uchar *>( bytes.constData() + pos ));
+        StorageEntry entry;
+        QByteArray payload, key;
+
+        if ( pos + length > bytes.size() || !Storage::readFrame( QByteArray::fromRawData( bytes.constData() + pos, static_cast<int>( length )), payload )) {
+            pos++;
+            skipped++;
+            continue;
+        }
+        pos += length;
+
+        QDataStream stream( payload );
+        stream >> key >> entry.offset >> entry.length;
+        if ( stream.status() != QDataStream::Ok || entry.offset < 0 || entry.offset + entry.length > this->data.size())
+            continue;
+
+        if ( this->entries.contains( key ))
+            this->deadBytes += this->entries[key].length;
+
+        this->entries[key] = entry;
+    }
+    skipped += bytes.size() - pos;
+    this->indexPos = this->index.size();
+
+    // report
+    if ( skipped )
+        qDebug() << QObject::tr( "Storage::refresh: skipped %1 damaged bytes in \"%2\"" ).arg( skipped ).arg( QFileInfo( this->m_fileName ).fileName());
+
+    return true;
+}
+
+/**
+ * @brief Storage::reset discards all entries
+ * @param version
+ * @return
+ */
+bool Storage::reset( quint8 version ) {
+    const QFileInfo info( this->m_fileName );
+    QFile outIndex( this->m_fileName + StorageSystem::IndexSuffix + StorageSystem::CompactSuffix );
+    QFile outData( this->m_fileName + StorageSystem::DataSuffix + StorageSystem::CompactSuffix );
+    QFile marker( this->m_fileName + StorageSystem::CommitSuffix );
+    bool ok;
+
+    this->entries.clear();
+    this->pendingEntries.clear();
+    this->pendingData.clear();
+    this->pendingCount = 0;
+    this->deadBytes = 0;
+
+    if ( !this->lock())
+        return false;
+
+    if ( !this->index.size() && !this->data.size()) {
+        // new store, write header
+        this->index.toStart();
+        this->index << version;
+        ok = this->index.datasync();
+    } else {
+        // other instances may have the files mapped, empty ones are swapped in instead of truncating
+        ok = outIndex.open( QFile::WriteOnly | QFile::Truncate ) && outData.open( QFile::WriteOnly | QFile::Truncate );
+        if ( ok ) {
+            QDataStream indexStream( &outIndex );
+            indexStream << version;
+            ok = indexStream.status() == QDataStream::Ok && FileStream::datasync( outIndex );
+        }
+        outIndex.close();
+        outData.close();
+
+        if ( ok && marker.open( QFile::WriteOnly )) {
+            marker.close();
+            this->index.close();
+            this->data.close();
+            Storage::commit( info.absolutePath(), QStringList() << info.fileName() + StorageSystem::IndexSuffix << info.fileName() + StorageSystem::DataSuffix, info.fileName() + StorageSystem::CommitSuffix );
+            ok = this->index.open() && this->data.open();
+            this->identify();
+        } else {
+            outIndex.remove();
+            outData.remove();
+            ok = false;
+        }
+    }
+
+    this->m_version = version;
+    this->indexPos = this->index.size();
+    this->unlock();
+
+    return ok;
+}
+
+/**
+ * @brief Storage::value
+ * @param key
+ * @return value (empty if missing or damaged)
+ */
+QByteArray Storage::value( const QByteArray &key ) {
+    StorageEntry entry;
+    QByteArray frame, payload;
+
+    if ( this->pendingEntries.contains( key )) {
+        // not flushed yet
+        entry = this->pendingEntries[key];
+        frame = QByteArray::fromRawData( this->pendingData.constData() + entry.offset, static_cast<int>( entry.length ));
+    } else if ( this->entries.contains( key )) {
+        entry = this->entries[key];
+
+        // data file only grows by appending in flush(), remap only when the entry lies beyond the mapping
+        if ( this->data.mapped() == nullptr || entry.offset + entry.length > this->data.mappedSize()) {
+            if ( this->data.map() == nullptr || entry.offset + entry.length > this->data.mappedSize())
+                return QByteArray();
+        }
+
+        frame = QByteArray::fromRawData( reinterpret_cast<const char *>( this->data.mapped()) + entry.offset, static_cast<int>( entry.length ));
+    } else {
+        return QByteArray();
+    }
+
+    // copy out, views are only valid until the next remap or flush
+    if ( !Storage::readFrame( frame, payload ))
+        return QByteArray();
+
+    return QByteArray( payload.constData(), payload.size());
+}
+
+/**
+ * @brief Storage::keys
+ * @return keys of stored and pending values
+ */
+QList<QByteArray> Storage::keys() const {
+    QList<QByteArray> list( this->entries.keys());
+
+    foreach ( const QByteArray &key, this->pendingEntries.keys()) {
+        if ( !this->entries.contains( key ))
+            list << key;
+    }
+
+    return list;
+}
+
+/**
+ * @brief Storage::insert appends a value (committed with the next batch)
+ * @param key
+ * @param value
+ * @return
+ */
+bool Storage::insert( const QByteArray &key, const QByteArray &value ) {
+    const StorageEntry entry( this->pendingData.size(), static_cast<quint32>( StorageSystem::FrameHeaderSize + value.size()));
+
+    if ( !this->isOpen())
+        return false;
+
+    // value frame, placed in the data file on flush
+    QDataStream dataStream( &this->pendingData, QIODevice::WriteOnly | QIODevice::Append );
+    Storage::writeFrame( dataStream, value );
+
+    this->pendingEntries[key] = entry;
+    this->pendingCount++;
+
+    // group commit
+    if ( this->pendingCount >= StorageSystem::BatchEntries || this->pendingData.size() >= StorageSystem::BatchBytes )
+        return this->flush();
+
+    return true;
+}
+
+/**
+ * @brief Storage::flush commits the batch, data first
+ * @return
+ */
+bool Storage::flush() {
+    QHash<QByteArray, StorageEntry> committed;
+    QHash<QByteArray, StorageEntry>::const_iterator i;
+    QByteArray pendingIndex;
+    qint64 base;
+    bool ok;
+
+    if ( !this->pendingCount )
+        return true;
+
+    if ( !this->isOpen())
+        return false;
+
+    // appends of other instances would interleave - kept for the next batch if busy
+    if ( !this->lock())
+        return false;
+
+    // records of other instances first, then the batch goes to the current end of the data file
+    ok = this->refresh();
+    base = this->data.size();
+    for ( i = this->pendingEntries.constBegin(); ok && i != this->pendingEntries.constEnd(); ++i ) {
+        const StorageEntry entry( base + i.value().offset, i.value().length );
+        QByteArray record;
+
+        QDataStream recordStream( &record, QIODevice::WriteOnly );
+        recordStream << i.key() << entry.offset << entry.length;
+        QDataStream indexStream( &pendingIndex, QIODevice::WriteOnly | QIODevice::Append );
+        Storage::writeFrame( indexStream, record );
+        committed[i.key()] = entry;
+    }
+
+    // an index record must never point past the data file
+    if ( ok )
+        ok = this->data.toEnd() && this->data.writeRawData( this->pendingData.constData(), this->pendingData.size()) == this->pendingData.size() && this->data.datasync();
+    if ( ok )
+        ok = this->index.toEnd() && this->index.writeRawData( pendingIndex.constData(), pendingIndex.size()) == pendingIndex.size() && this->index.datasync();
+
+    if ( ok ) {
+        for ( i = committed.constBegin(); i != committed.constEnd(); ++i ) {
+            if ( this->entries.contains( i.key()))
+                this->deadBytes += this->entries[i.key()].length;
+            this->entries[i.key()] = i.value();
+        }
+
+        // own records need not be read back
+        this->indexPos = this->index.size();
+    } else {
+        qDebug() << QObject::tr( "Storage::flush: could not commit %1 entries to \"%2\"" ).arg( this->pendingCount ).arg( QFileInfo( this->m_fileName ).fileName());
+    }
+
+    this->data.resetStatus();
+    this->index.resetStatus();
+    this->pendingData.clear();
+    this->pendingEntries.clear();
+    this->pendingCount = 0;
+    this->unlock();
+
+    return ok;
+}
+
+/**
+ * @brief Storage::compact rewrites live entries into fresh files and swaps them in
+ * @return
+ */
+bool Storage::compact() {
+    const QFileInfo info( this->m_fileName );
+    const QStringList fileList( QStringList() << info.fileName() + StorageSystem::IndexSuffix << info.fileName() + StorageSystem::DataSuffix );
+    QFile outIndex( this->m_fileName + StorageSystem::IndexSuffix + StorageSystem::CompactSuffix );
+    QFile outData( this->m_fileName + StorageSystem::DataSuffix + StorageSystem::CompactSuffix );
+    QFile marker( this->m_fileName + StorageSystem::CommitSuffix );
+    QHash<QByteArray, StorageEntry> compacted;
+    QHash<QByteArray, StorageEntry>::const_iterator i;
+
+    // entries of other instances are carried over as well
+    if ( !this->lock())
+        return false;
+
+    if ( !this->flush() || !this->refresh() || !outIndex.open( QFile::WriteOnly | QFile::Truncate ) || !outData.open( QFile::WriteOnly | QFile::Truncate )) {
+        this->unlock();
+        return false;
+    }
+
+    QDataStream indexStream( &outIndex ), dataStream( &outData );
+    indexStream << this->m_version;
+
+    // copy live values, damaged ones are dropped
+    for ( i = this->entries.constBegin(); i != this->entries.constEnd(); ++i ) {
+        const QByteArray value( this->value( i.key()));
+        QByteArray record;
+        StorageEntry entry( outData.pos(), static_cast<quint32>( StorageSystem::FrameHeaderSize + value.size()));
+
+        if ( value.isEmpty() && i.value().length != StorageSystem::FrameHeaderSize )
+            continue;
+
+        Storage::writeFrame( dataStream, value );
+
+        QDataStream recordStream( &record, QIODevice::WriteOnly );
+        recordStream << i.key() << entry.offset << entry.length;
+        Storage::writeFrame( indexStream, record );
+        compacted[i.key()] = entry;
+    }
+
+    if ( indexStream.status() != QDataStream::Ok || dataStream.status() != QDataStream::Ok || !FileStream::datasync( outIndex ) || !FileStream::datasync( outData )) {
+        outIndex.remove();
+        outData.remove();
+        this->unlock();
+        return false;
+    }
+    outIndex.close();
+    outData.close();
+
+    // swap in, an interrupted swap is finished in open()
+    if ( !marker.open( QFile::WriteOnly )) {
+        this->unlock();
+        return false;
+    }
+    marker.close();
+
+    this->index.close();
+    this->data.close();
+    Storage::commit( info.absolutePath(), fileList, info.fileName() + StorageSystem::CommitSuffix );
+    if ( !this->index.open() || !this->data.open()) {
+        this->unlock();
+        return false;
+    }
+
+    this->entries = compacted;
+    this->deadBytes = 0;
+    this->indexPos = this->index.size();
+    this->identify();
+    this->unlock();
+
+    return true;
+}
+
+/**
+ * @brief Storage::identify remembers which files are open (compactions and resets replace them)
+ */
+void Storage::identify() {
+    Storage::statKey( this->m_fileName + StorageSystem::IndexSuffix, this->indexKey );
+    Storage::statKey( this->m_fileName + StorageSystem::DataSuffix, this->dataKey );
+}
+
+/**
+ * @brief Storage::writeFrame writes payload as ( length, crc32, payload )
+ * @param stream
+ * @param payload
+ */
+void Storage::writeFrame( QDataStream &stream, const QByteArray &payload ) {
+    stream << static_cast<quint32>( payload.size()) << Checksum::crc32( payload.constData(), static_cast<size_t>( payload.size()));
+    stream.writeRawData( payload.constData(), payload.size());
+}
+
+/**
+ * @brief Storage::readFrame verifies a frame
+ * @param frame
+ * @param payload view into frame
+ * @return
+ */
+bool Storage::readFrame( const QByteArray &frame, QByteArray &payload ) {
+    const uchar *header = reinterpret_cast<const uchar *>( frame.constData());
+    quint32 length, crc;
+
+    if ( frame.size() < StorageSystem::FrameHeaderSize )
+        return false;
+
+    length = qFromBigEndian<quint32>( header );
+    crc = qFromBigEndian<quint32>( header + 4 );
+    if ( static_cast<qint64>( length ) + StorageSystem::FrameHeaderSize != frame.size() || crc != Checksum::crc32( frame.constData() + StorageSystem::FrameHeaderSize, length ))
+        return false;
+
+    payload = QByteArray::fromRawData( frame.constData() + StorageSystem::FrameHeaderSize, static_cast<int>( length ));
+    return true;
+}
+
+/**
+ * @brief Storage::commit replaces files by their compacted copies if marked complete (discards them otherwise)
+ * @param path
+ * @param fileList
+ * @param marker
+ */
+void Storage::commit( const QString &path, const QStringList &fileList, const QString &marker ) {
+    QDir dir( path );
+
+    // compacted files are complete, replace the originals
+    if ( dir.exists( marker )) {
+        foreach ( const QString &fileName, fileList ) {
+            if ( dir.exists( fileName + StorageSystem::CompactSuffix )) {
+                dir.remove( fileName );
+                dir.rename( fileName + StorageSystem::CompactSuffix, fileName );
+            }
+        }
+        dir.remove( marker );
+        return;
+    }
+
+    // incomplete, discard
+    foreach ( const QString &fileName, fileList )
+        dir.remove( fileName + StorageSystem::CompactSuffix );
+}
+
+/**
+ * @brief Storage::statKey
+ * @param fileName
+ * @param key
+ * @return
+ */
+bool Storage::statKey( const QString &fileName, StatKey &key ) {
+#ifdef Q_OS_WIN32
+    BY_HANDLE_FILE_INFORMATION info;
+    HANDLE handle;
+    bool ok;
+
+    // no access rights needed to query file information
+    handle = CreateFileW( reinterpret_cast<const wchar_t *>( QDir::toNativeSeparators( fileName ).utf16()), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr );
+    if ( handle == INVALID_HANDLE_VALUE )
+        return false;
+
+    ok = GetFileInformationByHandle( handle, &info );
+    CloseHandle( handle );
+    if ( !ok )
+        return false;
+
+    key.device = info.dwVolumeSerialNumber;
+    key.inode = ( static_cast<quint64>( info.nFileIndexHigh ) << 32 ) | info.nFileIndexLow;
+    key.size = ( static_cast<qint64>( info.nFileSizeHigh ) << 32 ) | info.nFileSizeLow;
+
+    // FILETIME is in 100ns intervals
+    key.mtime = (( static_cast<qint64>( info.ftLastWriteTime.dwHighDateTime ) << 32 ) | info.ftLastWriteTime.dwLowDateTime ) * 100;
+#else
+    struct stat info;
+
+    if ( stat( QFile::encodeName( fileName ).constData(), &info ) != 0 )
+        return false;
+
+    key.device = static_cast<quint64>( info.st_dev );
+    key.inode = static_cast<quint64>( info.st_ino );
+    key.size = static_cast<qint64>( info.st_size );
+#ifdef Q_OS_MAC
+    key.mtime = static_cast<qint64>( info.st_mtimespec.tv_sec ) * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+    key.mtime = static_cast<qint64>( info.st_mtim.tv_sec ) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+#endif
+    return true;
+}
+
+/**
+ * @brief Storage::replaced
+ * @param fileName
+ * @param key stat key of the open file
+ * @return true if another file has been swapped in under the same name
+ */
+bool Storage::replaced( const QString &fileName, const StatKey &key ) {
+    StatKey current;
+
+    return Storage::statKey( fileName, current ) && !current.sameFile( key );
+}
+
+/**
+ * @brief StorageLock::setFileName
+ * @param fileName
+ */
+void StorageLock::setFileName( const QString &fileName ) {
+    this->release();
+    this->file.reset( fileName.isEmpty() ? nullptr : new QLockFile( fileName ));
+    if ( !this->file.isNull())
+        this->file->setStaleLockTime( 0 );
+}
+
+/**
+ * @brief StorageLock::lock (nestable)
+ * @param timeout in ms
+ * @return
+ */
+bool StorageLock::lock( int timeout ) {
+    if ( this->depth ) {
+        this->depth++;
+        return true;
+    }
+
+    if ( this->file.isNull() || !this->file->tryLock( timeout )) {
+        if ( timeout && !this->file.isNull())
+            qDebug() << QObject::tr( "StorageLock::lock: \"%1\" held by another instance" ).arg( QFileInfo( this->file->fileName()).fileName());
+        return false;
+    }
+
+    this->depth = 1;
+    return true;
+}
+
+/**
+ * @brief StorageLock::unlock
+ */
+void StorageLock::unlock() {
+    if ( this->depth && !--this->depth )
+        this->file->unlock();
+}
+
+/**
+ * @brief StorageLock::release drops all levels at once (shutdown)
+ */
+void StorageLock::release() {
+    if ( !this->depth )
+        return;
+
+    this->depth = 0;
+    this->file->unlock();
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2017 Zvaigznu Planetarijs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#pragma once
+
+//
+// includes
+//
+#include <QByteArray>
+#include <QHash>
+#include <QStringList>
+#include <QLockFile>
+#include <QScopedPointer>
+#include "filestream.h"
+#include "checksum.h"
+
+/**
+ * @brief The StorageSystem namespace
+ */
+namespace StorageSystem {
+    static const QString IndexSuffix( ".index" );
+    static const QString DataSuffix( ".data" );
+    static const QString CompactSuffix( ".compact" );
+    static const QString CommitSuffix( ".commit" );
+    static const QString LockSuffix( ".lock" );
+    static const int LockTimeout = 1000; // ms
+    static const int IndexHeaderSize = 1; // version
+    static const int FrameHeaderSize = 8; // payload length, crc32
+    static const int BatchEntries = 64;
+    static const int BatchBytes = 4194304;
+    static const int CompactionRatio = 50; // % of overwritten data that triggers compaction
+}
+
+/**
+ * @brief The StatKey struct
+ *
+ * identifies an unchanged file without reading its contents
+ */
+struct StatKey {
+    StatKey( quint64 d = 0, quint64 i = 0, qint64 s = 0, qint64 m = 0 ) : device( d ), inode( i ), size( s ), mtime( m ) {}
+    bool operator==( const StatKey &other ) const { return this->device == other.device && this->inode == other.inode && this->size == other.size && this->mtime == other.mtime; }
+    bool sameFile( const StatKey &other ) const { return this->device == other.device && this->inode == other.inode; }
+    quint64 device;
+    quint64 inode;
+    qint64 size;
+    qint64 mtime; // ns
+};
+inline uint qHash( const StatKey &key, uint seed = 0 ) { return qHash( key.inode, seed ) ^ qHash( key.mtime, seed ) ^ static_cast<uint>( key.device ); }
+
+// read/write operators
+inline static QDataStream &operator<<( QDataStream &out, const StatKey &k ) { out << k.device << k.inode << k.size << k.mtime; return out; }
+inline static QDataStream &operator>>( QDataStream &in, StatKey &k ) { in >> k.device >> k.inode >> k.size >> k.mtime; return in; }
+
+/**
+ * @brief The StorageLock class
+ *
+ * lock file serializing the writes of all instances sharing a set of files;
+ * nestable within an instance, a lock left behind by a crashed instance is
+ * taken over (never by age)
+ */
+class StorageLock {
+public:
+    StorageLock( const QString &fileName = QString()) : depth( 0 ) { this->setFileName( fileName ); }
+    void setFileName( const QString &fileName );
+    bool lock( int timeout );
+    void unlock();
+    void release();
+
+private:
+    Q_DISABLE_COPY( StorageLock )
+    QScopedPointer<QLockFile> file;
+    int depth;
+};
+
+/**
+ * @brief The StorageEntry struct (position of a data frame)
+ */
+struct StorageEntry {
+    StorageEntry( qint64 o = 0, quint32 l = 0 ) : offset( o ), length( l ) {}
+    qint64 offset;
+    quint32 length;
+};
+
+/**
+ * @brief The Storage class
+ *
+ * append-only key/blob store made of an index and a data file, both written
+ * as crc-protected frames; appends are batched and committed with one sync per
+ * file, values are read from a mapping, torn frames are skipped and
+ * overwritten values are reclaimed by compaction
+ *
+ * several instances may share the files: batches are appended under a lock
+ * file (offsets assigned only then), records of other instances are picked up
+ * on each flush; files are never truncated, only swapped
+ *
+ * NOTE: not thread-safe, owners serialize access
+ */
+class Storage {
+public:
+    Storage() : pendingCount( 0 ), deadBytes( 0 ), indexPos( 0 ), m_version( 0 ) {}
+    ~Storage() { this->close(); }
+    bool open( const QString &fileName, quint8 version );
+    void close();
+    bool isOpen() { return this->index.isOpen() && this->data.isOpen(); }
+    quint8 version() const { return this->m_version; }
+    bool reset( quint8 version );
+    bool contains( const QByteArray &key ) const { return this->pendingEntries.contains( key ) || this->entries.contains( key ); }
+    QByteArray value( const QByteArray &key );
+    bool insert( const QByteArray &key, const QByteArray &value );
+    QList<QByteArray> keys() const;
+    int count() const { return this->keys().count(); }
+    bool flush();
+    bool compact();
+
+    // shared with Cache
+    static void writeFrame( QDataStream &stream, const QByteArray &payload );
+    static bool readFrame( const QByteArray &frame, QByteArray &payload );
+    static void commit( const QString &path, const QStringList &fileList, const QString &marker );
+    static bool statKey( const QString &fileName, StatKey &key );
+    static bool replaced( const QString &fileName, const StatKey &key );
+    template<typename T>
+    static void writeRecord( QDataStream &stream, const T &record ) {
+        QByteArray bytes;
+        QDataStream out( &bytes, QIODevice::WriteOnly );
+
+        out << record;
+        stream.writeRawData( bytes.constData(), bytes.size());
+        stream << Checksum::crc32( bytes.constData(), static_cast<size_t>( bytes.size()));
+    }
+    template<typename T>
+    static bool readRecord( QDataStream &stream, T &record, int size ) {
+        QByteArray bytes( size - 4, Qt::Uninitialized );
+        quint32 crc;
+
+        if ( stream.readRawData( bytes.data(), bytes.size()) != bytes.size())
+            return false;
+
+        stream >> crc;
+        if ( stream.status() != QDataStream::Ok || crc != Checksum::crc32( bytes.constData(), static_cast<size_t>( bytes.size())))
+            return false;
+
+        QDataStream in( bytes );
+        in >> record;
+        return in.status() == QDataStream::Ok;
+    }
+
+private:
+    Q_DISABLE_COPY( Storage )
+    bool read();
+    bool refresh();
+    void identify();
+    bool lock( int timeout = StorageSystem::LockTimeout ) { return this->writerLock.lock( timeout ); }
+    void unlock() { this->writerLock.unlock(); }
+    FileStream index;
+    FileStream data;
+    QString m_fileName;
+    QHash<QByteArray, StorageEntry> entries;
+    QHash<QByteArray, StorageEntry> pendingEntries; // offsets into pendingData
+    QByteArray pendingData;
+    int pendingCount;
+    qint64 deadBytes;
+    qint64 indexPos; // index records read so far
+    StatKey indexKey;
+    StatKey dataKey;
+    StorageLock writerLock;
+    quint8 m_version;
+};
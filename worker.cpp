@@ -29,15 +29,16 @@
 #include <QtConcurrent>
 #include <QSysInfo>
 #include "worker.h"
+#include "indexer.h"
 #include "cache.h"
 #include <QRgb>
 
 /**
- * @brief Worker::extractPixmap
+ * @brief Worker::extractIcon
  * @param path
  * @return
  */
-QPixmap Worker::extractPixmap( const QString &path, bool &ok, bool jumbo ) {
+QImage Worker::extractIcon( const QString &path, bool &ok, bool jumbo ) {
 #ifdef Q_OS_WIN32
     SHFILEINFO shellInfo;
     QPixmap pixmap;
@@ -61,11 +62,12 @@ QPixmap Worker::extractPixmap( const QString &path, bool &ok, bool jumbo ) {
                     HICON hIcon;
 
                     if ( SUCCEEDED( imageList->GetIcon( shellInfo.iIcon, ILD_TRANSPARENT, &hIcon ))) {
+                        // NOTE: raster pixmap on windows, converted right away
                         pixmap = QtWin::fromHICON( hIcon );
                         DestroyIcon( hIcon );
 
                         if ( pixmap.isNull())
-                            return QPixmap();
+                            return QImage();
 
                         if ( jumbo ) {
                             // NOTE: ugly hack
@@ -89,7 +91,7 @@ QPixmap Worker::extractPixmap( const QString &path, bool &ok, bool jumbo ) {
                             if ( !jumbo )
                                 ok = true;
 
-                            return pixmap;
+                            return pixmap.toImage().convertToFormat( QImage::Format_ARGB32_Premultiplied );
                         }
                     }
                 }
@@ -99,77 +101,92 @@ QPixmap Worker::extractPixmap( const QString &path, bool &ok, bool jumbo ) {
 
             if ( !pixmap.isNull() && pixmap.width()) {
                 ok = true;
-                return pixmap;
+                return pixmap.toImage().convertToFormat( QImage::Format_ARGB32_Premultiplied );
             }
         }
     }
+#else
+    Q_UNUSED( path )
+    Q_UNUSED( jumbo )
+    ok = false;
 #endif
-    return QPixmap();
+    return QImage();
 }
 
 /**
  * @brief Worker::generateThumbnail
- * @param path
+ * @param contents file contents
  * @param scale
  * @param ok
- * @return
+ * @param token checked between decoding and scaling
+ * @param format tried if the contents are not recognized (formats without a signature, e.g. tga)
+ * @return premultiplied image, RGB32 if opaque (QPixmap is for the gui thread only)
  */
-QPixmap Worker::generateThumbnail( const QString &path, int scale, bool &ok ) {
+QImage Worker::generateThumbnail( const QByteArray &contents, int scale, bool &ok, const WorkToken &token, const QByteArray &format ) {
     QRect rect;
-    QPixmap pixmap;
+    QImage image;
+    QImage::Format target;
 
     ok = false;
 
-    if ( !pixmap.load( path ))
-        return pixmap;
+    if ( !image.loadFromData( contents ) && ( format.isEmpty() || !image.loadFromData( contents, format.constData())))
+        return QImage();
+
+    if ( token.isCancelled())
+        return QImage();
+
+    if ( image.isNull() && !image.width())
+        return image;
 
-    if ( pixmap.isNull() && !pixmap.width())
-        return pixmap;
+    // opaque sources stay without alpha, so they can still be stored as jpeg
+    target = image.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32;
 
-    if ( pixmap.height() > scale || pixmap.width() > scale ) {
-        if ( pixmap.width() > pixmap.height())
-            rect = QRect( pixmap.width() / 2 - pixmap.height() / 2, 0, pixmap.height(), pixmap.height());
-        else if ( pixmap.width() < pixmap.height())
-            rect = QRect( 0, pixmap.height() / 2 - pixmap.width() / 2, pixmap.width(), pixmap.width());
+    if ( image.height() > scale || image.width() > scale ) {
+        if ( image.width() > image.height())
+            rect = QRect( image.width() / 2 - image.height() / 2, 0, image.height(), image.height());
+        else if ( image.width() < image.height())
+            rect = QRect( 0, image.height() / 2 - image.width() / 2, image.width(), image.width());
 
-        pixmap = pixmap.copy( rect );
+        image = image.copy( rect );
 
-        if ( pixmap.width() >= scale * 2.0f )
-            pixmap = pixmap.scaled( scale * 2.0f, scale * 2.0f, Qt::IgnoreAspectRatio, Qt::FastTransformation );
+        if ( image.width() >= scale * 2.0f )
+            image = image.scaled( scale * 2.0f, scale * 2.0f, Qt::IgnoreAspectRatio, Qt::FastTransformation );
 
-        pixmap = pixmap.scaled( scale, scale, Qt::IgnoreAspectRatio, Qt::SmoothTransformation );
+        // converted once, on the few remaining pixels
+        image = image.convertToFormat( target );
+        image = image.scaled( scale, scale, Qt::IgnoreAspectRatio, Qt::SmoothTransformation );
+    } else {
+        image = image.convertToFormat( target );
     }
 
     ok = true;
-    return pixmap;
+    return image;
 }
 
 /**
- * @brief Worker::scalePixmap
- * @param path
+ * @brief Worker::scaleImage
+ * @param image
  * @param scale
- * @param ok
  * @return
  */
-QPixmap Worker::scalePixmap( const QPixmap &pixmap, int scale ) {
-    if ( pixmap.isNull() && !pixmap.width())
-        return pixmap;
+QImage Worker::scaleImage( const QImage &image, int scale ) {
+    if ( image.isNull() && !image.width())
+        return image;
 
-    return pixmap.scaled( scale, scale, Qt::IgnoreAspectRatio, Qt::SmoothTransformation );
+    return image.scaled( scale, scale, Qt::IgnoreAspectRatio, Qt::SmoothTransformation );
 }
 
 /**
- * @brief Worker::generatePixmapLevels
- * @param pixmap
+ * @brief Worker::generateImageLevels
+ * @param image
  * @return
  */
-QList<QPixmap> Worker::generatePixmapLevels( const QPixmap &pixmap ) {
-    const int numPixmapLevels = 4;
-    int pixmapLevels[numPixmapLevels] = { 64, 48, 32, 16 }, y;
-    QList<QPixmap> list;
+QList<QImage> Worker::generateImageLevels( const QImage &image ) {
+    QList<QImage> list;
+    int y;
 
-    for ( y = 0; y < numPixmapLevels; y++ )
-        list << Worker::scalePixmap( pixmap, pixmapLevels[y] );
+    for ( y = 0; y < CacheSystem::NumPixmapLevels; y++ )
+        list << Worker::scaleImage( image, CacheSystem::PixmapLevels[y] );
 
     return list;
 }
@@ -177,27 +194,55 @@ QList<QPixmap> Worker::generatePixmapLevels( const QPixmap &pixmap ) {
 /**
  * @brief Worker::work
  * @param fileName
+ * @param token checked between steps, the result is incomplete once cancelled
+ * @param contents read by the hashing stage (read here otherwise)
  * @return
  */
-DataEntry Worker::work( const QString &fileName ) {
+DataEntry Worker::work( const QString &fileName, const WorkToken &token, const QByteArray &contents ) {
     DataEntry data;
-    QPixmap pixmap;
+    QImage image;
     QMimeDatabase db;
     QFileInfo info( fileName );
+    QByteArray bytes( contents );
+    QFile file( fileName );
+
+    if ( token.isCancelled())
+        return data;
 
     // files larger than the current 10MB get handled differently:
     //   - no thumbnail caching;
-    //   - checksum is generated for the first 10MB
+    //   - checksum is sampled from head, middle and tail (see HashPolicy)
     //   - icon is extracted anyway
     if ( info.size() > CacheSystem::MaxFileSize ) {
         data.mimeType = db.mimeTypeForFile( info, QMimeDatabase::MatchExtension ).name();
     } else {
-        data.mimeType = db.mimeTypeForFile( info, QMimeDatabase::MatchContent ).name();
-        if ( data.mimeType.startsWith( "image/" )) {
+        // not handed over - read the header for sniffing, the rest only for images
+        if ( bytes.isEmpty() && info.size() > 0 && file.open( QFile::ReadOnly )) {
+            bytes = file.read( CacheSystem::SniffSize );
+            SourceBuffer::count( bytes.size());
+        }
+
+        // unreadable - nothing to sniff, go by extension (an empty buffer would pass for an empty file)
+        if ( bytes.isEmpty() && info.size() > 0 ) {
+            data.mimeType = db.mimeTypeForFile( info, QMimeDatabase::MatchExtension ).name();
+        } else {
+            // one read, sniffed and decoded from the same buffer (the name settles formats without magic bytes)
+            data.mimeType = db.mimeTypeForFileNameAndData( fileName, bytes ).name();
+        }
+
+        if ( data.mimeType.startsWith( "image/" ) && !bytes.isEmpty() && !token.isCancelled()) {
             bool ok;
-            pixmap = Worker::generateThumbnail( info.absoluteFilePath(), 64, ok );
-            if ( ok )
-                data.pixmapList = Worker::generatePixmapLevels( pixmap );
+
+            if ( file.isOpen()) {
+                const QByteArray rest( file.read( CacheSystem::MaxFileSize - bytes.size()));
+
+                SourceBuffer::count( rest.size());
+                bytes.append( rest );
+            }
+
+            image = Worker::generateThumbnail( bytes, 64, ok, token, info.suffix().toLatin1());
+            if ( ok && !token.isCancelled())
+                data.imageList = Worker::generateImageLevels( image );
         }
     }
 
@@ -206,15 +251,15 @@ DataEntry Worker::work( const QString &fileName ) {
         bool ok;
 
         // extract jumbo first
-        pixmap = Worker::extractPixmap( info.absoluteFilePath(), ok, true );
+        image = Worker::extractIcon( info.absoluteFilePath(), ok, true );
         if ( ok )
-            data.pixmapList = Worker::generatePixmapLevels( pixmap );
+            data.imageList = Worker::generateImageLevels( image );
         else {
             // then extra large icon
-            pixmap = Worker::extractPixmap( info.absoluteFilePath(), ok );
+            image = Worker::extractIcon( info.absoluteFilePath(), ok );
 
             if ( ok )
-                data.pixmapList = Worker::generatePixmapLevels( pixmap );
+                data.imageList = Worker::generateImageLevels( image );
         }
     }
 
@@ -227,18 +272,22 @@ DataEntry Worker::work( const QString &fileName ) {
 void Worker::run() {
     // enter event loop
     while ( !this->isInterruptionRequested()) {
-        QMutexLocker( &this->m_mutex );
-
-        // LIFO - prioritizing most recent entries
-        if ( !this->workList.isEmpty()) {
-            Work work;
-            work = this->workList.takeLast();
-            work.data = this->work( work.fileName );
+        Work work;
+
+        // sleeps until there is work (most urgent - closest to the viewport center - first)
+        if ( !this->pool->take( this->index, work ))
+            continue;
+
+        // a directory we already left - partial results are not cached
+        const WorkToken token( this->generation, work.generation );
+        work.data = Worker::work( work.fileName, token, work.source.isNull() ? QByteArray() : work.source->bytes );
+        work.source.clear();
+        Indexer::release( work.fileName );
+        if ( !token.isCancelled())
             emit this->workDone( work );
 
-            // TODO: if this is the last one, emit finished and FLUSH TO DISK!!!
-        } else {
-            msleep( 100 );
-        }
+        // all queues drained - let the cache commit its batch
+        if ( this->pool->isEmpty())
+            emit this->idle();
     }
 }
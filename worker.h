@@ -22,10 +22,10 @@
 // includes
 //
 #include <QThread>
-#include <QMutex>
 #include <QDebug>
 #include <QMimeType>
 #include "cache.h"
+#include "workqueue.h"
 
 /**
  * @brief The Worker class
@@ -34,22 +34,23 @@ class Worker : public QThread {
     Q_OBJECT
 
 public:
-    static QPixmap generateThumbnail( const QString &path, int scale, bool &ok );
-    static QPixmap extractPixmap( const QString &path, bool &ok, bool jumbo = false );
-    static QPixmap scalePixmap( const QPixmap &pixmap, int scale );
-    static QList<QPixmap> generatePixmapLevels( const QPixmap &pixmap );
+    static QImage generateThumbnail( const QByteArray &contents, int scale, bool &ok, const WorkToken &token = WorkToken(), const QByteArray &format = QByteArray());
+    static QImage extractIcon( const QString &path, bool &ok, bool jumbo = false );
+    static QImage scaleImage( const QImage &image, int scale );
+    static QList<QImage> generateImageLevels( const QImage &image );
+    Worker( WorkPool<Work> *pool, int index, const QAtomicInt *generation = nullptr ) : pool( pool ), index( index ), generation( generation ) {}
+    static DataEntry work( const QString &fileName, const WorkToken &token = WorkToken(), const QByteArray &contents = QByteArray());
 
 public slots:
-    void addWork( const Work &work ) { QMutexLocker( &this->m_mutex ); this->workList << work; }
-    void addWork( QList<Work> list ) { QMutexLocker( &this->m_mutex ); this->workList << list; }
-    void clear() { QMutexLocker( &this->m_mutex ); this->workList.clear(); }
+    void interrupt() { this->requestInterruption(); this->pool->queue( this->index )->interrupt(); }
 
 signals:
     void workDone( const Work & );
+    void idle();
 
 private:
     void run();
-    DataEntry work( const QString &fileName );
-    QList<Work> workList;
-    mutable QMutex m_mutex;
+    WorkPool<Work> *pool;
+    int index;
+    const QAtomicInt *generation;
 };
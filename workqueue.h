@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2017 Zvaigznu Planetarijs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#pragma once
+
+//
+// includes
+//
+#include <QList>
+#include <QVector>
+#include <QHash>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInt>
+#include <algorithm>
+#include <limits>
+
+/**
+ * @brief The WorkSystem namespace
+ */
+namespace WorkSystem {
+    static const int Unranked = std::numeric_limits<int>::max(); // no longer on screen
+}
+
+/**
+ * @brief The WorkToken class
+ *
+ * cancellation token of a job; cancelled once the shared generation it was
+ * queued in moves on (a default token is never cancelled)
+ */
+class WorkToken {
+public:
+    WorkToken( const QAtomicInt *current = nullptr, int generation = 0 ) : current( current ), generation( generation ) {}
+    bool isCancelled() const { return this->current != nullptr && this->current->load() != this->generation; }
+
+private:
+    const QAtomicInt *current;
+    int generation;
+};
+
+/**
+ * @brief The WorkQueue class
+ *
+ * priority queue between producers and a single consumer thread; the lowest
+ * priority value goes first, equal ones in LIFO order (most recent first);
+ * take() sleeps on a wait condition until work arrives, so idle threads never
+ * wake up and new work is picked up right away; wake() and interrupt()
+ * release the consumer without work (to run idle tasks or to exit), nudge()
+ * does so only if it is asleep
+ */
+template<typename T>
+class WorkQueue {
+public:
+    WorkQueue() : woken( false ), interrupted( false ), waiting( false ), order( 0 ) {}
+
+    void add( const T &item, bool unique = false ) {
+        QMutexLocker locker( &this->mutex );
+
+        if ( unique ) {
+            foreach ( const Pending &entry, this->pending ) {
+                if ( entry.item == item )
+                    return;
+            }
+        }
+
+        this->push( item, 0 );
+        this->condition.wakeOne();
+    }
+
+    void add( const QList<T> &items ) {
+        QMutexLocker locker( &this->mutex );
+
+        foreach ( const T &item, items )
+            this->push( item, 0 );
+        this->condition.wakeOne();
+    }
+
+    void schedule( const T &item, int priority ) {
+        QMutexLocker locker( &this->mutex );
+
+        this->push( item, priority );
+        this->condition.wakeOne();
+    }
+
+    void schedule( const QList<T> &items, const QList<int> &priorities ) {
+        QMutexLocker locker( &this->mutex );
+        int y;
+
+        for ( y = 0; y < items.count(); y++ )
+            this->push( items.at( y ), priorities.value( y, WorkSystem::Unranked ));
+        this->condition.wakeOne();
+    }
+
+    // new priorities (by item key), items without one go last
+    template<typename Key>
+    void reprioritize( const QHash<QString, int> &ranks, Key key ) {
+        QMutexLocker locker( &this->mutex );
+        int y;
+
+        for ( y = 0; y < this->pending.count(); y++ )
+            this->pending[y].priority = ranks.value( key( this->pending.at( y ).item ), WorkSystem::Unranked );
+        std::make_heap( this->pending.begin(), this->pending.end(), WorkQueue::later );
+    }
+
+    void clear() {
+        QMutexLocker locker( &this->mutex );
+        this->pending.clear();
+    }
+
+    bool isEmpty() const {
+        QMutexLocker locker( &this->mutex );
+        return this->pending.isEmpty();
+    }
+
+    int count() const {
+        QMutexLocker locker( &this->mutex );
+        return this->pending.count();
+    }
+
+    // priority of the first item in line
+    bool peek( int &priority ) const {
+        QMutexLocker locker( &this->mutex );
+
+        if ( this->pending.isEmpty())
+            return false;
+
+        priority = this->pending.first().priority;
+        return true;
+    }
+
+    // items next in line
+    QList<T> next( int count ) const {
+        QMutexLocker locker( &this->mutex );
+        QVector<Pending> first( qMin( count, this->pending.count()));
+        QList<T> items;
+
+        std::partial_sort_copy( this->pending.constBegin(), this->pending.constEnd(), first.begin(), first.end(), []( const Pending &a, const Pending &b ) { return WorkQueue::later( b, a ); } );
+        foreach ( const Pending &entry, first )
+            items << entry.item;
+
+        return items;
+    }
+
+    // blocks until there is work (false if woken up or interrupted instead, or
+    // if the stamp has moved on from the value seen by the caller)
+    bool take( T &item, const QAtomicInt *stamp = nullptr, int seen = 0 ) {
+        QMutexLocker locker( &this->mutex );
+
+        while ( this->pending.isEmpty() && !this->woken && !this->interrupted && ( stamp == nullptr || stamp->load() == seen )) {
+            this->waiting = true;
+            this->condition.wait( &this->mutex );
+            this->waiting = false;
+        }
+
+        this->woken = false;
+        if ( this->interrupted || this->pending.isEmpty())
+            return false;
+
+        item = this->pop();
+        return true;
+    }
+
+    // non-blocking take
+    bool tryTake( T &item ) {
+        QMutexLocker locker( &this->mutex );
+
+        if ( this->pending.isEmpty())
+            return false;
+
+        item = this->pop();
+        return true;
+    }
+
+    void wake() {
+        QMutexLocker locker( &this->mutex );
+
+        this->woken = true;
+        this->condition.wakeAll();
+    }
+
+    // wakes the consumer only if it sleeps in take()
+    void nudge() {
+        QMutexLocker locker( &this->mutex );
+
+        if ( !this->waiting )
+            return;
+
+        this->woken = true;
+        this->condition.wakeAll();
+    }
+
+    void interrupt() {
+        QMutexLocker locker( &this->mutex );
+
+        this->interrupted = true;
+        this->condition.wakeAll();
+    }
+
+private:
+    Q_DISABLE_COPY( WorkQueue )
+    struct Pending {
+        T item;
+        int priority;
+        quint64 order;
+    };
+
+    // heap order - true if a goes after b
+    static bool later( const Pending &a, const Pending &b ) { return a.priority > b.priority || ( a.priority == b.priority && a.order < b.order ); }
+
+    void push( const T &item, int priority ) {
+        const Pending entry = { item, priority, this->order++ };
+
+        this->pending << entry;
+        std::push_heap( this->pending.begin(), this->pending.end(), WorkQueue::later );
+    }
+
+    T pop() {
+        std::pop_heap( this->pending.begin(), this->pending.end(), WorkQueue::later );
+        return this->pending.takeLast().item;
+    }
+
+    QVector<Pending> pending;
+    mutable QMutex mutex;
+    QWaitCondition condition;
+    bool woken;
+    bool interrupted;
+    bool waiting;
+    quint64 order;
+};
+
+/**
+ * @brief The WorkPool class
+ *
+ * one WorkQueue per consumer thread; work is dealt out round-robin and each
+ * consumer takes the most urgent item of all queues (stealing from siblings
+ * if that is not in its own) before going to sleep; sleeping consumers are
+ * nudged whenever any queue receives work, so it is never left to a busy one
+ */
+template<typename T>
+class WorkPool {
+public:
+    WorkPool() {}
+    ~WorkPool() { qDeleteAll( this->queues ); }
+
+    // before consumers are started
+    void setSize( int size ) {
+        qDeleteAll( this->queues );
+        this->queues.clear();
+        while ( this->queues.count() < qMax( 1, size ))
+            this->queues << new WorkQueue<T>();
+    }
+
+    int size() const { return this->queues.count(); }
+    WorkQueue<T> *queue( int index ) const { return this->queues.at( index ); }
+
+    void schedule( const T &item, int priority ) {
+        if ( this->queues.isEmpty())
+            return;
+
+        this->queues.at( this->next())->schedule( item, priority );
+        this->nudge();
+    }
+
+    void schedule( const QList<T> &items, const QList<int> &priorities ) {
+        QList<QList<T> > batches;
+        QList<QList<int> > batchPriorities;
+        int y, first;
+
+        if ( this->queues.isEmpty())
+            return;
+
+        // one lock (and wakeup) per queue
+        first = this->next();
+        for ( y = 0; y < this->queues.count(); y++ ) {
+            batches << QList<T>();
+            batchPriorities << QList<int>();
+        }
+        for ( y = 0; y < items.count(); y++ ) {
+            const int k = ( first + y ) % this->queues.count();
+
+            batches[k] << items.at( y );
+            batchPriorities[k] << priorities.value( y, WorkSystem::Unranked );
+        }
+        for ( y = 0; y < batches.count(); y++ ) {
+            if ( !batches.at( y ).isEmpty())
+                this->queues.at( y )->schedule( batches.at( y ), batchPriorities.at( y ));
+        }
+        this->nudge();
+    }
+
+    template<typename Key>
+    void reprioritize( const QHash<QString, int> &ranks, Key key ) {
+        foreach ( WorkQueue<T> *queue, this->queues )
+            queue->reprioritize( ranks, key );
+    }
+
+    void clear() {
+        foreach ( WorkQueue<T> *queue, this->queues )
+            queue->clear();
+    }
+
+    bool isEmpty() const {
+        foreach ( WorkQueue<T> *queue, this->queues ) {
+            if ( !queue->isEmpty())
+                return false;
+        }
+        return true;
+    }
+
+    void interrupt() {
+        foreach ( WorkQueue<T> *queue, this->queues )
+            queue->interrupt();
+    }
+
+    // the most urgent item of all queues (own queue on ties), otherwise sleep on own queue
+    // (unless work has been scheduled anywhere since the search began)
+    bool take( int index, T &item ) {
+        const int seen = this->scheduled.load();
+        WorkQueue<T> *best = nullptr;
+        int y, priority, top = WorkSystem::Unranked;
+
+        for ( y = 0; y < this->queues.count(); y++ ) {
+            WorkQueue<T> *queue = this->queues.at(( index + y ) % this->queues.count());
+
+            if ( queue->peek( priority ) && ( best == nullptr || priority < top )) {
+                best = queue;
+                top = priority;
+            }
+        }
+
+        if ( best != nullptr && best->tryTake( item ))
+            return true;
+
+        return this->queues.at( index )->take( item, &this->scheduled, seen );
+    }
+
+private:
+    Q_DISABLE_COPY( WorkPool )
+    int next() { return static_cast<int>( static_cast<uint>( this->position.fetchAndAddRelaxed( 1 )) % static_cast<uint>( this->queues.count())); }
+
+    // after the work is queued - consumers that see the new stamp also see the work
+    void nudge() {
+        this->scheduled.ref();
+        foreach ( WorkQueue<T> *queue, this->queues )
+            queue->nudge();
+    }
+
+    QList<WorkQueue<T> *> queues;
+    QAtomicInt position;
+    QAtomicInt scheduled;
+};